@@ -23,10 +23,27 @@
 #include <stdio.h>
 #include <assert.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define BT_HAVE_IO_URING
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BT_HAVE_SIMD_SEARCH
+#endif
+
 #include "btree.h"
 #include "list.h"
 
@@ -43,38 +60,37 @@ Files Structure:
     each block have same size, blk0 -> Meta Block
 
 
-Contents in different type of block
-    BTreeNodeBlk followed by:
+Contents in different type of block (version 1)
+    BTreeNodeBlk followed by a key array and a value/child array, each one
+    slot larger than a full node needs, so a node can overflow by one key in
+    memory before it is split. The block in memory is the same as on disk.
 
     LEAF_NODE or ROOT_LEAF_NODE
 
-        [V0 K0 V1 K1 ... Vm Km]     
+        [K0 K1 ... Km | spare] [V0 V1 ... Vm | spare]
             ROOT:        m is [0, order - 1]
             NON ROOT:    m is [(order - 1) / 2, (order - 1)]
 
-        +----+----+--------+-----+-----------+------------+
-        | k0 | k1 |  ....  | Km  |   empty   | K(order-1) |
-        +----+----+--------+-----+-----------+------------+
-        |    |    |  ...   |
-        V0   V1   V2       Vm
-
-        Ki: uint_64 keys (i = 1:(order-1))
+        Ki: uint_64 keys
         Vi: uint_64 values
 
 
     ROOT_NODE or INTERNAL_NODE
 
-        [CN0 K0 CN1 K1 CN2 K2 ... CNm Km CN(m+1)]
+        [K0 K1 ... Km | spare] [CN0 CN1 ... CNm CN(m+1) | spare]
             ROOT:      m is [1, order - 1]
             INTERNAL:  m is [(order - 1) / 2, (order - 1)]
 
-        +----+----+--------+-----+-----------+------------+
-        | k0 | k1 |  ....  | Km  |   empty   | K(order-1) |
-        +----+----+--------+-----+-----------+------------+
-        |    |    |  ...   |
-       CN0  CN1  CN2      CNm
+        cni: uint_64 blk index to children node
+
+    keys of a node are contiguous, so searching a node only touches the
+    key array.
 
-        cni: uint_64 blk index to children node 
+
+Legacy layout (version 0) interleaves keys and values/children:
+    [V0 K0 V1 K1 ... Vm Km]  or  [CN0 K0 CN1 K1 ... CNm Km CN(m+1)]
+    without spare slots. Such a file is converted once when it's opened,
+    see bt_upgrade_legacy_file.
 */
 
 // Represent MetaData on disk 
@@ -86,10 +102,26 @@ typedef struct {
     uint64_t root_blkid;
     uint64_t blk_counts;
     uint64_t max_blkid;
+    uint64_t version;       // 0 for legacy files, layout of node blocks
+    uint64_t generation;    // increased by every bt_flush that writes
+    // block map of version 3 files, see BTreeShadow
+    uint64_t map_dir_blkid;
+    uint64_t map_dir_blocks;
+    uint64_t phys_blocks;
+    // first deleted block, each one links the next by right_sibling_blkid.
+    // 0 in files from before deletion, padding is zero.
+    uint64_t free_blkid;
+    // none leaf nodes keep pairs under each child, see bt_node_get_counts.
+    // 0 in older files, they are never counted.
+    uint64_t counted;
     // padding to blk_size
 } BTreeMetaBlk;
 
 # define BTREE_FILE_MAGIC 0xbbbbbbbb
+# define BTREE_FILE_VERSION_LEGACY 0
+# define BTREE_FILE_VERSION_SOA    1   // version 1 maintain parent_blkid
+# define BTREE_FILE_VERSION        2
+# define BTREE_FILE_VERSION_SHADOW 3   // version 2 nodes behind a block map
 
 typedef struct {
     BTreeMetaBlk *blk;
@@ -99,27 +131,45 @@ typedef struct {
 #define BT_NODE_TYPE_ROOT      1
 #define BT_NODE_TYPE_INTERNAL  2
 #define BT_NODE_TYPE_LEAF      4
+#define BT_NODE_TYPE_FREE      8   // block of a deleted node, see free_blkid
 
 // Represent Tree Node on disk 
 typedef struct {
     // fixed content
     uint64_t type;
     uint64_t key_counts;
+    // not maintained since version 2, parent is known from the search path,
+    // so moving a child to another node doesn't make it dirty.
     uint64_t parent_blkid;
+    // only LEAF nodes are linked
     uint64_t left_sibling_blkid;
     uint64_t right_sibling_blkid;
+    uint64_t key_capacity;      // length of key array, equals to order
     // key and pointers is decided by order of the tree:
-    // for i = 0:order-2
-    //     uint64_t child_i_index or value
-    //     uint64_t key_i     
-    // and one extra:
-    // uint64_t child_order-1_index 
-      
+    // uint64_t keys[order]
+    // uint64_t child_index or value [order + 1]
+    // uint64_t pairs under child [order + 1], only in counted trees
 
-    // sizeof(key and pointers) = (order * 2 - 1 ) * 64
+    // sizeof(key and pointers) = (order * 2 + 1 ) * 64, (order * 3 + 2) * 64 if counted
     // block size = sizeof(key and pointers) + sizeof(BTreeNodeBlk)
 } BTreeNodeBlk;
 
+// the meta block is a block of the file too, so it must fit the smallest
+// one, of order 3 without counts. a field more in BTreeMetaBlk would break
+// trees of order 3, see bt_new_empty.
+_Static_assert(sizeof(BTreeMetaBlk) <= sizeof(BTreeNodeBlk) + (3 * 2 + 1) * sizeof(uint64_t),
+               "meta block larger than a node block of order 3");
+
+// Node block of version 0 files, only used to upgrade them
+typedef struct {
+    uint64_t type;
+    uint64_t key_counts;
+    uint64_t parent_blkid;
+    uint64_t left_sibling_blkid;
+    uint64_t right_sibling_blkid;
+    // [V0 K0 V1 K1 ...] or [CN0 K0 CN1 K1 ... CNm]
+} BTreeLegacyNodeBlk;
+
 typedef struct {
     BTree                 *tree;
     BTreeNodeBlk          *blk;     
@@ -127,12 +177,73 @@ typedef struct {
       
     struct list_head       chain;      // new or dirty or deleted?
     struct list_head      *state;      // which chain this node in? (the block status)    
+
+    struct list_head       pool_chain;  // position in clock of the pool
+    int                    referenced;  // accessed since clock hand passed
+    int                    pins;        // pinned node is never evicted
 } BTreeNode;
 
+// loaded nodes of a tree by blkid, open addressing with linear probing.
+// sized to nodes in memory rather than blocks in file.
+typedef struct {
+    uint64_t     size;          // slots, power of 2
+    uint64_t     count;         // nodes in table
+    BTreeNode  **slots;
+} BTreeNodeTable;
+
+// fixed size frames, each holds a BTreeNode followed by its blk.
+// frames are cut from page aligned chunks and never returned to malloc
+// until the slab is destoryed.
+typedef struct BTreeSlab {
+    uint64_t           frame_size;  // multiple of cache line
+    uint64_t           chunk_size;  // multiple of page
+    void              *free_frames; // linked through first word of frame
+    void              *chunks;      // linked through first word of chunk
+    struct BTreeSlab  *next;        // next slab of the pool
+} BTreeSlab;
+
+// nodes in memory, shared by trees using the pool
+struct _BTreePool {
+    uint64_t           capacity;    // bytes, 0 for unlimited
+    uint64_t           used;        // bytes used by nodes in memory
+    uint64_t           nodes;       // nodes in memory
+    struct list_head   clock;       // nodes in clock order, hand is at the head
+
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+    uint64_t           write_backs;
+
+    BTreeSlab         *slabs;       // one slab for each frame size in use
+    struct _BTreeIO   *io;          // io_uring shared by trees, NULL till asked for
+};
+
+// height of tree never exceed 64, a node has at least 2 children
+#define BT_MAX_HEIGHT 64
+
+// nodes from root to leaf visited by a search
+typedef struct {
+    uint64_t       depth;       // steps[depth - 1] is the leaf
+    struct {
+        BTreeNode *node;
+        uint64_t   index;       // child index taken in none leaf node
+    } steps[BT_MAX_HEIGHT];
+} BTreePath;
+
+// a key/value pair given by caller
+typedef struct {
+    uint64_t       key;
+    uint64_t       value;
+} BTreePair;
+
+typedef struct _BTreeIO BTreeIO;
+typedef struct _BTreeLog BTreeLog;
+typedef struct _BTreeShadow BTreeShadow;
 
 struct _BTree {
     char          *file_path;
     int            file_fd;
+    BTreeIO       *io;          // backend all blocks are read and written by
 
     BTreeNode     *root;
     BTreeMeta     *meta;
@@ -141,18 +252,35 @@ struct _BTree {
     struct list_head     new_node_chain;
     struct list_head     deleted_node_chain;
     struct list_head     dirty_node_chain;
+    uint64_t             dirty_counts;      // nodes in new and dirty chain
 
     // calculated by meta for convenience
     uint64_t       min_keys; //for none root
     uint64_t       max_keys; //for none root
 
     // node will be loaded to memory first time it is accessed
-    // we keep blkidx to node here, not loaded node have value NULL.
-    BTreeNode    **blkid_to_node;
+    // we keep blkidx to node here, not loaded node is not in the table.
+    BTreeNodeTable nodes;
+
+    // blocks written by the last flush and since open
+    BTreeFlushStat flush_stat;
+
+    // redo log of inserts since last flush, NULL if not enabled
+    BTreeLog      *log;
+    // block map of shadow paging, NULL if blocks are written in place
+    BTreeShadow   *shadow;
+
+    // pinned path to the rightmost leaf, depth 0 if not kept
+    BTreePath      append_path;
+
+    // loaded nodes are accounted here, may be evicted by the pool
+    BTreePool     *pool;
+    int            own_pool;    // private pool, destoryed with the tree
+    BTreeSlab     *slab;        // slab of pool nodes of this tree come from
 };
 
 static BTreeValues *bt_values_new();
-static void bt_values_put_value(BTreeValues *values, uint64_t value);
+static void bt_values_reserve(BTreeValues *values, uint64_t n);
 
 static uint64_t bt_next_blkid(BTree *bt);
 static uint64_t bt_get_order(BTree *bt);
@@ -160,8 +288,20 @@ static uint64_t bt_get_max_keys(BTree *bt);
 static uint64_t bt_get_min_keys(BTree *bt);
 static uint64_t bt_get_blksize(BTree *bt);
 static void bt_load_blk(BTree *bt, void *dst, uint64_t index);
+static void bt_load_blks(BTree *bt, void **dsts, uint64_t *blkids, uint64_t n);
+static int bt_compare_blkid(const void *a, const void *b);
+static uint64_t bt_phys_blkid(BTree *bt, uint64_t blkid);
 static void bt_set_node(BTree *bt, uint64_t blkid, BTreeNode *node);
+static void bt_unset_node(BTree *bt, uint64_t blkid);
 static BTreeNode *bt_get_node(BTree *bt, uint64_t blkid);
+static BTreeNode *bt_node_table_get(BTreeNodeTable *table, uint64_t blkid);
+static void bt_store_blk(BTree *bt, uint64_t blkid);
+static void bt_pool_add(BTreePool *pool, BTreeNode *node);
+static void bt_node_write_back(BTreeNode *node);
+static void bt_pool_remove(BTreePool *pool, BTreeNode *node);
+static BTreeNode *bt_node_alloc(BTree *bt);
+static void bt_slab_free(BTreeSlab *slab, void *frame);
+static void bt_io_destory(BTreeIO *io);
 
 
 
@@ -183,6 +323,7 @@ static BTreeMetaBlk *bt_meta_blk_new_empty(uint64_t order, uint64_t blksize)
     blk->blk_counts = 1;
     blk->max_blkid = 0;
     blk->root_blkid = 1;
+    blk->version = BTREE_FILE_VERSION;
     return blk;
 }
 
@@ -193,6 +334,9 @@ static BTreeMetaBlk *bt_meta_blk_new_from_file(BTree *bt)
     blk = (BTreeMetaBlk *)malloc(sizeof(BTreeMetaBlk));
     bt_load_blk(bt, blk, 0);    // metablk has blkid 0
     assert(blk->magic == BTREE_FILE_MAGIC);   // bad tree file
+    // legacy file should be upgraded before
+    assert(blk->version == BTREE_FILE_VERSION || blk->version == BTREE_FILE_VERSION_SOA ||
+           blk->version == BTREE_FILE_VERSION_SHADOW);
     blk = (BTreeMetaBlk *)realloc(blk, blk->blk_size);
 
     memset((char *)blk + sizeof(BTreeMetaBlk), 0, blk->blk_size - sizeof(BTreeMetaBlk));
@@ -234,6 +378,14 @@ static BTreeMeta *bt_meta_new_from_file(BTree *bt)
     meta->dirty = 0;
     meta->blk = blk;
 
+    // version 1 node blocks are valid version 2 blocks, stale parent_blkid
+    // is ignored. mark the file as version 2 at next flush.
+    if (blk->version == BTREE_FILE_VERSION_SOA)
+    {
+        blk->version = BTREE_FILE_VERSION;
+        meta->dirty = 1;
+    }
+
     return meta;
 }
 
@@ -268,6 +420,23 @@ static uint64_t bt_meta_get_maxblkid(BTreeMeta *meta)
     return meta->blk->max_blkid;
 }
 
+static uint64_t bt_meta_next_generation(BTreeMeta *meta)
+{
+    meta->dirty = 1;
+    return ++meta->blk->generation;
+}
+
+static uint64_t bt_meta_get_generation(BTreeMeta *meta)
+{
+    return meta->blk->generation;
+}
+
+static void bt_meta_set_generation(BTreeMeta *meta, uint64_t generation)
+{
+    meta->dirty = 1;
+    meta->blk->generation = generation;
+}
+
 static uint64_t bt_meta_next_blkid(BTreeMeta *meta)
 {
     meta->dirty = 1;
@@ -275,6 +444,32 @@ static uint64_t bt_meta_next_blkid(BTreeMeta *meta)
     return ++meta->blk->max_blkid;
 }
 
+static int bt_meta_is_counted(BTreeMeta *meta)
+{
+    return meta->blk->counted != 0;
+}
+
+static uint64_t bt_meta_get_free_blkid(BTreeMeta *meta)
+{
+    return meta->blk->free_blkid;
+}
+
+// a deleted block becomes head of free list, it links the old head
+static void bt_meta_push_free_blkid(BTreeMeta *meta, uint64_t blkid)
+{
+    meta->dirty = 1;
+    meta->blk->blk_counts--;
+    meta->blk->free_blkid = blkid;
+}
+
+// head of free list is used again, next one becomes head
+static void bt_meta_pop_free_blkid(BTreeMeta *meta, uint64_t next)
+{
+    meta->dirty = 1;
+    meta->blk->blk_counts++;
+    meta->blk->free_blkid = next;
+}
+
 
 
 
@@ -302,38 +497,44 @@ static void bt_node_blk_set_type(BTreeNodeBlk *blk, int type)
     blk->type = type;
 }
 
-static uint64_t bt_node_blk_get_parent_blkid(BTreeNodeBlk *blk)
+static uint64_t bt_node_blk_get_left_sibling_blkid(BTreeNodeBlk *blk)
 {
-    return blk->parent_blkid;
+    return blk->left_sibling_blkid;
 }
 
-// not used for now
-/*
+static uint64_t bt_node_blk_get_right_sibling_blkid(BTreeNodeBlk *blk)
+{
+    return blk->right_sibling_blkid;
+}
 
-static uint64_t bt_node_blk_get_left_sibling_blkid(BTreeNodeBlk *blk)
+static uint64_t *bt_node_blk_keys(BTreeNodeBlk *blk)
 {
-    return blk->left_sibling_blkid;
+    return (uint64_t *)((char *)blk + sizeof(BTreeNodeBlk));
 }
 
-*/
+// values of LEAF node, children blkid of none LEAF node
+static uint64_t *bt_node_blk_slots(BTreeNodeBlk *blk)
+{
+    return bt_node_blk_keys(blk) + blk->key_capacity;
+}
 
-static uint64_t bt_node_blk_get_right_sibling_blkid(BTreeNodeBlk *blk)
+// pairs under each child of none LEAF node, only in blocks of counted trees
+static uint64_t *bt_node_blk_counts(BTreeNodeBlk *blk)
 {
-    return blk->right_sibling_blkid;
+    return bt_node_blk_slots(blk) + blk->key_capacity + 1;
 }
 
 // index range from [0, key_counts - 1]
 static uint64_t bt_node_blk_get_key(BTreeNodeBlk *blk, uint64_t index)
 {
     assert(blk->key_counts >0 && index < blk->key_counts);
-    return *(uint64_t *)
-            ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2 + 1));
+    return bt_node_blk_keys(blk)[index];
 }
 
 static void bt_node_blk_set_key(BTreeNodeBlk *blk, uint64_t index, uint64_t key)
 {
-    *(uint64_t *)
-        ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2 + 1)) = key;
+    assert(index < blk->key_capacity);
+    bt_node_blk_keys(blk)[index] = key;
 }
 
 // index range from [0, key_counts - 1]
@@ -341,9 +542,7 @@ static uint64_t bt_node_blk_get_value(BTreeNodeBlk *blk, uint64_t index)
 {
     assert(blk->type & BT_NODE_TYPE_LEAF);
     assert(index < blk->key_counts);
-    return *(uint64_t *)
-            ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2));
-
+    return bt_node_blk_slots(blk)[index];
 }
 
 //not used for now
@@ -354,8 +553,7 @@ static void bt_node_blk_set_value(BTreeNodeBlk *blk, uint64_t index, uint64_t va
 {
     assert(blk->type & BT_NODE_TYPE_LEAF);
     assert(index < blk->key_counts);
-    *(uint64_t *)
-        ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2)) = value;
+    bt_node_blk_slots(blk)[index] = value;
 
 }
 
@@ -366,29 +564,28 @@ static uint64_t bt_node_blk_get_child_blkid(BTreeNodeBlk *blk, uint64_t index)
 {
     assert(!(blk->type & BT_NODE_TYPE_LEAF));
     assert(index <= blk->key_counts);
-    return *(uint64_t *)
-            ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2));
+    return bt_node_blk_slots(blk)[index];
 }
 
 static void bt_node_blk_set_child_blkid(BTreeNodeBlk *blk, uint64_t index, uint64_t blkid)
 {
     assert(!(blk->type & BT_NODE_TYPE_LEAF));
-    *(uint64_t *)
-        ((char *)blk + sizeof(BTreeNodeBlk) + sizeof(uint64_t) * (index * 2)) = blkid;
+    assert(index <= blk->key_capacity);
+    bt_node_blk_slots(blk)[index] = blkid;
 }
 
 // copy key/value or key/idx pair from srcto dst
 // caller do link.
 static void bt_node_blk_copy_half_pairs(BTreeNodeBlk *dst, BTreeNodeBlk *src, uint64_t start, uint64_t n)
 {
-    uint64_t content_offset;
+    uint64_t slots;
 
-    //assert(start + n <= max_keys);
-    content_offset = sizeof(BTreeNodeBlk);
-    n = n * 2 * sizeof(uint64_t);
+    assert(start + n <= src->key_capacity);
+    slots = n;
     if (!(dst->type & BT_NODE_TYPE_LEAF))
-        n += sizeof(uint64_t);
-    memcpy((char*) dst + content_offset , (char *)src + content_offset + sizeof(int64_t) * (start * 2), n);
+        slots += 1;
+    memcpy(bt_node_blk_keys(dst), bt_node_blk_keys(src) + start, n * sizeof(uint64_t));
+    memcpy(bt_node_blk_slots(dst), bt_node_blk_slots(src) + start, slots * sizeof(uint64_t));
 }
 
 static void bt_node_blk_link_sibling(BTreeNodeBlk *left, BTreeNodeBlk *right, uint64_t left_idx, uint64_t right_idx)
@@ -397,70 +594,324 @@ static void bt_node_blk_link_sibling(BTreeNodeBlk *left, BTreeNodeBlk *right, ui
     right->left_sibling_blkid = left_idx;
 }
 
-static void bt_node_blk_link_parent_child(BTreeNodeBlk *parent, BTreeNodeBlk *child, uint64_t parent_blkid, uint64_t child_blkid, uint64_t index)
-{
-    bt_node_blk_set_child_blkid(parent, index, child_blkid);
-    child->parent_blkid = parent_blkid;
-}
 
 
-static uint64_t bt_node_blk_leaf_search(BTreeNodeBlk *blk, uint64_t key)
+// lower bound search kernels, both return index of the first key >= key,
+// or key_counts if there is no such key. works for leaf and none leaf node.
+// with duplicate keys, the index of the first equal key is returned.
+typedef uint64_t (*BTreeKeysSearch)(const uint64_t *keys, uint64_t n, uint64_t key);
+
+static uint64_t bt_keys_linear_search(const uint64_t *keys, uint64_t n, uint64_t key)
 {
     uint64_t pos;
 
     pos = 0;
                                                             // not <= here. we want index of *key* tha equal to key
-    while (pos < blk->key_counts && bt_node_blk_get_key(blk, pos) < key)
+    while (pos < n && keys[pos] < key)
         pos ++;
 
     return pos;
 }
 
+static uint64_t bt_keys_binary_search(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    uint64_t low, high, mid;
+
+    // keep: keys before low < key, keys from high >= key
+    low = 0;
+    high = n;
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+#ifdef BT_HAVE_SIMD_SEARCH
+
+// simd kernels narrow [low, high) by binary search until it is small
+// enough, then count keys < key in the window with vector compares.
+// since keys are sorted, the count is the offset of lower bound in window.
+#define BT_SIMD_SEARCH_WINDOW 32
+
+// there is no unsigned 64 bit compare, flip sign bit and compare signed.
+__attribute__((target("avx2")))
+static uint64_t bt_keys_avx2_count_less(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    __m256i  sign, k, v;
+    uint64_t i, count;
+    int      mask;
+
+    sign = _mm256_set1_epi64x(INT64_MIN);
+    k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+    count = 0;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), sign);
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v)));
+        count += __builtin_popcount(mask);
+        if (mask != 0xf)
+            return count;
+    }
+    for (; i < n && keys[i] < key; i++)
+        count++;
+
+    return count;
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t bt_keys_sse42_count_less(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    __m128i  sign, k, v;
+    uint64_t i, count;
+    int      mask;
+
+    sign = _mm_set1_epi64x(INT64_MIN);
+    k = _mm_xor_si128(_mm_set1_epi64x(key), sign);
+    count = 0;
+    for (i = 0; i + 2 <= n; i += 2)
+    {
+        v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), sign);
+        mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, v)));
+        count += __builtin_popcount(mask);
+        if (mask != 0x3)
+            return count;
+    }
+    for (; i < n && keys[i] < key; i++)
+        count++;
+
+    return count;
+}
+
+__attribute__((target("avx2")))
+static uint64_t bt_keys_avx2_search(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    uint64_t low, high, mid;
+
+    low = 0;
+    high = n;
+    while (high - low > BT_SIMD_SEARCH_WINDOW)
+    {
+        mid = low + (high - low) / 2;
+        if (keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low + bt_keys_avx2_count_less(keys + low, high - low, key);
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t bt_keys_sse42_search(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    uint64_t low, high, mid;
+
+    low = 0;
+    high = n;
+    while (high - low > BT_SIMD_SEARCH_WINDOW)
+    {
+        mid = low + (high - low) / 2;
+        if (keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low + bt_keys_sse42_count_less(keys + low, high - low, key);
+}
+
+#endif // BT_HAVE_SIMD_SEARCH
+
+// best simd kernel this cpu supports, NULL if none
+static BTreeKeysSearch bt_keys_simd_kernel()
+{
+#ifdef BT_HAVE_SIMD_SEARCH
+    if (__builtin_cpu_supports("avx2"))
+        return bt_keys_avx2_search;
+    if (__builtin_cpu_supports("sse4.2"))
+        return bt_keys_sse42_search;
+#endif
+    return NULL;
+}
+
+static uint64_t bt_keys_auto_search(const uint64_t *keys, uint64_t n, uint64_t key);
+static BTreeKeysSearch bt_keys_search = bt_keys_auto_search;
+
+// pick kernel by cpuid on first search
+static uint64_t bt_keys_auto_search(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    bt_set_search_kernel(BT_SEARCH_AUTO);
+    return bt_keys_search(keys, n, key);
+}
+
+int bt_set_search_kernel(int kernel)
+{
+    BTreeKeysSearch simd;
+
+    simd = bt_keys_simd_kernel();
+    switch (kernel)
+    {
+    case BT_SEARCH_AUTO:
+        bt_keys_search = simd ? simd : bt_keys_binary_search;
+        break;
+    case BT_SEARCH_LINEAR:
+        bt_keys_search = bt_keys_linear_search;
+        break;
+    case BT_SEARCH_BINARY:
+        bt_keys_search = bt_keys_binary_search;
+        break;
+    case BT_SEARCH_SIMD:
+        if (simd == NULL)
+            return -1;
+        bt_keys_search = simd;
+        break;
+    default:
+        assert(0);  // unknown kernel
+    }
+    return 0;
+}
+
+uint64_t bt_keys_lower_bound(const uint64_t *keys, uint64_t n, uint64_t key)
+{
+    return bt_keys_search(keys, n, key);
+}
+
+static uint64_t bt_node_blk_search(BTreeNodeBlk *blk, uint64_t key)
+{
+    return bt_keys_search(bt_node_blk_keys(blk), blk->key_counts, key);
+}
+
+static uint64_t bt_node_blk_leaf_search(BTreeNodeBlk *blk, uint64_t key)
+{
+    assert(blk->type & BT_NODE_TYPE_LEAF);
+    return bt_node_blk_search(blk, key);
+}
+
+// index of the child that may contain key
+static uint64_t bt_node_blk_none_leaf_search(BTreeNodeBlk *blk, uint64_t key)
+{
+    assert(!(blk->type & BT_NODE_TYPE_LEAF));
+    return bt_node_blk_search(blk, key);
+}
+
 // insert a key,value pair into a LEAF node blk
 // The allocated blk in memory can hold one more (key/value)!
 // after this function return, the blk can hold one more key than max_keys
 static void bt_node_blk_leaf_insert(BTreeNodeBlk *blk, uint64_t key, uint64_t value)
 {
     uint64_t  pos;
-    char     *src;
-    char     *dest;
+    uint64_t *keys;
+    uint64_t *values;
     uint64_t  n;
 
     assert(blk->type & BT_NODE_TYPE_LEAF);
+    assert(blk->key_counts < blk->key_capacity);
 
-    pos = bt_node_blk_leaf_search(blk, key);
-    
-    src = (char *)blk + sizeof(BTreeNodeBlk) + pos * sizeof(uint64_t) * 2;
-    dest = src + 2 *sizeof(uint64_t);
-    n = (blk->key_counts - pos) * 2 * sizeof(uint64_t);
-    memmove(dest, src, n);
+    keys = bt_node_blk_keys(blk);
+    // appending rowid or time like keys needs no search
+    if (blk->key_counts == 0 || key > keys[blk->key_counts - 1])
+        pos = blk->key_counts;
+    else
+        pos = bt_node_blk_leaf_search(blk, key);
+
+    values = bt_node_blk_slots(blk);
+    n = (blk->key_counts - pos) * sizeof(uint64_t);
+    memmove(keys + pos + 1, keys + pos, n);
+    memmove(values + pos + 1, values + pos, n);
 
-    *(uint64_t *)src = value;
-    *((uint64_t *)(src) + 1) = key;
+    keys[pos] = key;
+    values[pos] = value;
 
     blk->key_counts += 1;
 }
 
+// merge n sorted pairs into LEAF node from the end backwards, each key is
+// moved once. pairs go before keys equal to them, as leaf insert does.
+static void bt_node_blk_leaf_merge(BTreeNodeBlk *blk, const BTreePair *pairs, uint64_t n)
+{
+    uint64_t *keys;
+    uint64_t *values;
+    uint64_t  i, k;
+
+    assert(blk->type & BT_NODE_TYPE_LEAF);
+    assert(blk->key_counts + n <= blk->key_capacity);
+
+    keys = bt_node_blk_keys(blk);
+    values = bt_node_blk_slots(blk);
+    i = blk->key_counts;
+    k = i + n;
+    blk->key_counts = k;
+    while (n > 0)
+    {
+        k--;
+        if (i > 0 && keys[i - 1] >= pairs[n - 1].key)
+        {
+            i--;
+            keys[k] = keys[i];
+            values[k] = values[i];
+        }
+        else
+        {
+            n--;
+            keys[k] = pairs[n].key;
+            values[k] = pairs[n].value;
+        }
+    }
+}
+
+// remove n pairs from index pos of LEAF node
+static void bt_node_blk_leaf_remove(BTreeNodeBlk *blk, uint64_t pos, uint64_t n)
+{
+    uint64_t  size;
+
+    assert(blk->type & BT_NODE_TYPE_LEAF);
+    assert(pos + n <= blk->key_counts);
+
+    size = (blk->key_counts - pos - n) * sizeof(uint64_t);
+    memmove(bt_node_blk_keys(blk) + pos, bt_node_blk_keys(blk) + pos + n, size);
+    memmove(bt_node_blk_slots(blk) + pos, bt_node_blk_slots(blk) + pos + n, size);
+    blk->key_counts -= n;
+}
+
+// remove key at index and the child right to it from none leaf node
+static void bt_node_blk_none_leaf_remove(BTreeNodeBlk *blk, uint64_t index)
+{
+    uint64_t *keys;
+    uint64_t *children;
+
+    assert(!(blk->type & BT_NODE_TYPE_LEAF));
+    assert(index < blk->key_counts);
+
+    keys = bt_node_blk_keys(blk);
+    children = bt_node_blk_slots(blk);
+    memmove(keys + index, keys + index + 1, (blk->key_counts - index - 1) * sizeof(uint64_t));
+    memmove(children + index + 1, children + index + 2, (blk->key_counts - index - 1) * sizeof(uint64_t));
+    blk->key_counts--;
+}
+
+// make space for key at index and child at index
 void bt_node_blk_none_leaf_make_space(BTreeNodeBlk *blk, uint64_t index)
 {
-    char *src;
-    char *dest;
-    uint64_t n;
+    uint64_t *keys;
+    uint64_t *children;
 
     assert(!(blk->type & BT_NODE_TYPE_LEAF));
-    src = (char *)blk + sizeof(BTreeNodeBlk) + index * sizeof(uint64_t) * 2;
-    dest = src + sizeof(uint64_t) * 2;
-    n = (blk->key_counts - index) *  2 * sizeof(uint64_t) + sizeof(uint64_t);
-    
-    memmove(dest, src, n);
+    assert(blk->key_counts < blk->key_capacity);
+
+    keys = bt_node_blk_keys(blk);
+    children = bt_node_blk_slots(blk);
+    memmove(keys + index + 1, keys + index, (blk->key_counts - index) * sizeof(uint64_t));
+    memmove(children + index + 1, children + index, (blk->key_counts - index + 1) * sizeof(uint64_t));
 }
 
-static BTreeNodeBlk *bt_node_blk_new_empty(uint64_t blk_size, uint64_t type)
+static void bt_node_blk_init(BTreeNodeBlk *blk, uint64_t blk_size, uint64_t capacity, uint64_t type)
 {
-    BTreeNodeBlk *blk;
-    uint64_t      mem_size;
-    mem_size = blk_size + sizeof(uint64_t) * 2;
-    blk =  (BTreeNodeBlk *)malloc(mem_size);
     // prevent valgrind complain Syscall param write(buf) points to uninitialised byte(s)
     memset(blk, 0, blk_size);
     blk->type = type;
@@ -468,22 +919,24 @@ static BTreeNodeBlk *bt_node_blk_new_empty(uint64_t blk_size, uint64_t type)
     blk->left_sibling_blkid = 0;
     blk->right_sibling_blkid = 0;
     blk->key_counts = 0;
-
-    return blk;
+    blk->key_capacity = capacity;
 }
 
-static BTreeNodeBlk *bt_node_blk_new_from_file(BTree *bt, uint64_t blkid)
+static BTreeNodeBlk *bt_node_blk_new_empty(uint64_t blk_size, uint64_t capacity, uint64_t type)
 {
     BTreeNodeBlk *blk;
-    uint64_t      blksize;
+    blk =  (BTreeNodeBlk *)malloc(blk_size);
+    bt_node_blk_init(blk, blk_size, capacity, type);
 
-    blksize = bt_get_blksize(bt);
-    blk =  (BTreeNodeBlk *)malloc(blksize + sizeof(uint64_t) * 2);
-    memset(blk, 0, blksize);
-    bt_load_blk(bt, blk, blkid);
     return blk;
 }
 
+static void bt_node_blk_load(BTree *bt, BTreeNodeBlk *blk, uint64_t blkid)
+{
+    bt_load_blk(bt, blk, blkid);
+    assert(blk->key_capacity == bt_get_order(bt));
+}
+
 static void bt_node_blk_destory(BTreeNodeBlk *blk)
 {
     free(blk);
@@ -507,6 +960,7 @@ static void bt_node_marked_dirty(BTreeNode *node)
     
     node->state = &node->tree->dirty_node_chain;
     list_add(&node->chain, &node->tree->dirty_node_chain);
+    node->tree->dirty_counts++;
 }
 
 static void bt_node_marked_new(BTreeNode *node)
@@ -514,6 +968,16 @@ static void bt_node_marked_new(BTreeNode *node)
     assert(node->state == NULL);
     node->state = &node->tree->new_node_chain;
     list_add(&node->chain, &node->tree->new_node_chain);
+    node->tree->dirty_counts++;
+}
+
+// block of node is written
+static void bt_node_marked_clean(BTreeNode *node)
+{
+    assert(node->state != NULL);
+    list_del(&node->chain);
+    node->state = NULL;
+    node->tree->dirty_counts--;
 }
 
 uint64_t bt_node_get_blkid(BTreeNode *node)
@@ -570,8 +1034,28 @@ static void bt_node_set_key_count(BTreeNode *node, uint64_t count)
     bt_node_marked_dirty(node);
 }
 
-// not used for now
-/*
+// pairs under each child, NULL for LEAF node or if tree is not counted
+static uint64_t *bt_node_get_counts(BTreeNode *node)
+{
+    if (!bt_meta_is_counted(node->tree->meta) || (bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+        return NULL;
+    return bt_node_blk_counts(node->blk);
+}
+
+// pairs under node of a counted tree
+static uint64_t bt_node_get_size(BTreeNode *node)
+{
+    uint64_t *counts;
+    uint64_t  i, size;
+
+    counts = bt_node_get_counts(node);
+    if (!counts)
+        return bt_node_get_key_count(node);
+    size = 0;
+    for (i = 0; i <= bt_node_get_key_count(node); i++)
+        size += counts[i];
+    return size;
+}
 
 static BTreeNode *bt_node_get_left_sibling(BTreeNode *node)
 {
@@ -584,8 +1068,6 @@ static BTreeNode *bt_node_get_left_sibling(BTreeNode *node)
     return bt_get_node(node->tree, blkid);
 }
 
-*/
-
 static BTreeNode *bt_node_get_right_sibling(BTreeNode *node)
 {
     uint64_t blkid;
@@ -597,17 +1079,6 @@ static BTreeNode *bt_node_get_right_sibling(BTreeNode *node)
     return bt_get_node(node->tree, blkid);
 }
 
-static BTreeNode *bt_node_get_parent(BTreeNode *node)
-{
-    uint64_t blkid;
-
-    blkid = bt_node_blk_get_parent_blkid(node->blk);
-    if (blkid == 0)
-        return NULL;
-        
-    return bt_get_node(node->tree, blkid);
-}
-
 static BTreeNode *bt_node_get_child(BTreeNode *node, uint64_t index)
 {
     uint64_t blkid;
@@ -628,43 +1099,40 @@ static void bt_node_link_sibling(BTreeNode *left, BTreeNode *right)
     bt_node_marked_dirty(right);
 }
 
+// child is not touched, no parent pointer on disk
 static void bt_node_link_parent_child(BTreeNode *parent, BTreeNode *child, uint64_t index)
 {
-    bt_node_blk_link_parent_child(parent->blk, child->blk, parent->blkid, child->blkid, index);
+    bt_node_blk_set_child_blkid(parent->blk, index, child->blkid);
 
     bt_node_marked_dirty(parent);
-    bt_node_marked_dirty(child);
 }
 
-static void bt_node_move_half_content(BTreeNode* new, BTreeNode *node, uint64_t min_keys)
+// move keys after the one at split to new node, the split key stays in
+// LEAF node and goes up to parent from none leaf node.
+static void bt_node_move_half_content(BTreeNode* new, BTreeNode *node, uint64_t split)
 {
-    uint64_t      i;
-    uint64_t      start;
+    uint64_t      start, n;
+    uint64_t     *counts;
 
-    start = min_keys + 1;
+    start = split + 1;
+    n = bt_node_get_key_count(node) - start;
 
-    // copy pairs
-    bt_node_blk_copy_half_pairs(new->blk, node->blk, start, min_keys);
-    
-    // if the node is not LEAF, link parent - child
-    if(!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
-    {
-        // copy one more.
-        for( i = 0; i <= min_keys ; i ++ )
-        {
-            bt_node_link_parent_child(new,bt_node_get_child(node, i+start), i);
-        }
-    }
+    // copy pairs, for none LEAF node one more child blkid is copied.
+    // moved children are not loaded, they don't know their parent.
+    bt_node_blk_copy_half_pairs(new->blk, node->blk, start, n);
+    counts = bt_node_get_counts(node);
+    if (counts)
+        memcpy(bt_node_get_counts(new), counts + start, (n + 1) * sizeof(uint64_t));
 
     // set key counts
-    bt_node_set_key_count(new, min_keys);
+    bt_node_set_key_count(new, n);
     if(bt_node_get_type(node) & BT_NODE_TYPE_LEAF)
     {
-        bt_node_set_key_count(node, min_keys + 1);   
+        bt_node_set_key_count(node, split + 1);
     }
     else
     {
-        bt_node_set_key_count(node, min_keys);   
+        bt_node_set_key_count(node, split);
     }
 
     bt_node_marked_dirty(node);
@@ -673,58 +1141,120 @@ static void bt_node_move_half_content(BTreeNode* new, BTreeNode *node, uint64_t
 
 static void bt_node_set_key_and_link(BTreeNode *parent, uint64_t index, uint64_t key, BTreeNode *left, BTreeNode *right)
 {
+    uint64_t *counts;
+
     bt_node_set_key(parent, index, key);
     bt_node_link_parent_child(parent, left, index);
     bt_node_link_parent_child(parent, right, index + 1);
-}
-
-static uint64_t bt_node_get_child_index(BTreeNode *node, BTreeNode *child)
-{
-    uint64_t index;
-
-    assert(!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF));
-    for (index = 0; index <= bt_node_get_key_count(node); index++)
+    counts = bt_node_get_counts(parent);
+    if (counts)
     {
-        if (bt_node_get_child(node, index) == child)
-            return index;
+        counts[index] = bt_node_get_size(left);
+        counts[index + 1] = bt_node_get_size(right);
     }
-    assert(0);
 }
 
 static BTreeNode *bt_node_new_empty(BTree *tree, uint64_t type)
 {
     BTreeNode    *node;
-    BTreeNodeBlk *blk;
 
-    blk = bt_node_blk_new_empty(bt_get_blksize(tree), type);
-    node = (BTreeNode *)malloc(sizeof(BTreeNode));
+    // block of a deleted node is used first
+    if (bt_meta_get_free_blkid(tree->meta))
+    {
+        node = bt_get_node(tree, bt_meta_get_free_blkid(tree->meta));
+        assert(bt_node_get_type(node) == BT_NODE_TYPE_FREE);
+        bt_meta_pop_free_blkid(tree->meta, bt_node_blk_get_right_sibling_blkid(node->blk));
+        bt_node_blk_init(node->blk, bt_get_blksize(tree), bt_get_order(tree), type);
+        bt_node_marked_dirty(node);
+        return node;
+    }
+
+    node = bt_node_alloc(tree);
+    bt_node_blk_init(node->blk, bt_get_blksize(tree), bt_get_order(tree), type);
     node->blkid = bt_next_blkid(tree);
-    node->blk = blk;
     node->tree = tree;
     node->state = NULL;
+    node->pins = 0;
     bt_node_marked_new(node); // init state and chain
 
     bt_set_node(tree, node->blkid, node);
+    bt_pool_add(tree->pool, node);
     
     return node;
 }
 
-static BTreeNode *bt_node_new_from_file(BTree *bt, uint64_t blkid)
+// node just read from file
+static void bt_node_attach(BTree *bt, BTreeNode *node, uint64_t blkid)
 {
-    BTreeNode    *node;
-    BTreeNodeBlk *blk;
-    blk =  bt_node_blk_new_from_file(bt, blkid);
-    node = (BTreeNode *)malloc(sizeof(BTreeNode));
-    node->blk = blk;
     node->blkid = blkid;
     node->tree = bt;
     node->state = NULL;     // clean node.
+    node->pins = 0;
 
     bt_set_node(bt, blkid, node);
+    bt_pool_add(bt->pool, node);
+}
+
+static BTreeNode *bt_node_new_from_file(BTree *bt, uint64_t blkid)
+{
+    BTreeNode    *node;
+
+    node = bt_node_alloc(bt);
+    bt_node_blk_load(bt, node->blk, blkid);
+    bt_node_attach(bt, node, blkid);
 
     return node;
 }
 
+// load nodes not in memory yet in one batch of reads, so they are
+// outstanding at the same time. blkids is sorted in place.
+static void bt_node_load_batch(BTree *bt, uint64_t *blkids, uint64_t n)
+{
+    BTreeNode **nodes;
+    void      **blks;
+    uint64_t    i;
+
+    qsort(blkids, n, sizeof(uint64_t), bt_compare_blkid);
+    nodes = (BTreeNode **)malloc(sizeof(BTreeNode *) * n);
+    blks = (void **)malloc(sizeof(void *) * n);
+    for (i = 0; i < n; i++)
+    {
+        assert(bt_node_table_get(&bt->nodes, blkids[i]) == NULL);
+        nodes[i] = bt_node_alloc(bt);
+        blks[i] = nodes[i]->blk;
+    }
+
+    bt_load_blks(bt, blks, blkids, n);
+
+    for (i = 0; i < n; i++)
+    {
+        bt_node_attach(bt, nodes[i], blkids[i]);
+        bt->pool->misses++;
+    }
+    free(blks);
+    free(nodes);
+}
+
+static void bt_node_pin(BTreeNode *node)
+{
+    node->pins++;
+}
+
+static void bt_node_unpin(BTreeNode *node)
+{
+    assert(node->pins > 0);
+    node->pins--;
+}
+
+// root is always in memory
+static void bt_set_root(BTree *bt, BTreeNode *root)
+{
+    if (bt->root)
+        bt_node_unpin(bt->root);
+    bt_node_pin(root);
+    bt->root = root;
+}
+
 static BTreeNode *bt_node_new_root_with_one_key(BTree *bt, uint64_t split_key, BTreeNode *left, BTreeNode *right)
 {
     BTreeNode    *new_root;
@@ -734,22 +1264,22 @@ static BTreeNode *bt_node_new_root_with_one_key(BTree *bt, uint64_t split_key, B
     bt_node_set_key_and_link(new_root, 0, split_key, left, right);
     bt_node_set_key_count(new_root , 1);
 
-    bt->root = new_root;
+    bt_set_root(bt, new_root);
     bt_set_root_blkid(bt, new_root->blkid);
 
     return new_root;
 }
 
-// cut the overfull(one more key than max_keys) node in to half. create and return new node.
-static BTreeNode *bt_node_cut(BTreeNode *node, uint64_t *split_key)
+// cut the overfull(one more key than max_keys) node at key index split,
+// usually min_keys to cut it in to half. create and return new node.
+static BTreeNode *bt_node_cut(BTreeNode *node, uint64_t split, uint64_t *split_key)
 {
     BTree        *tree;
     uint64_t      type;
     BTreeNode    *new;
-    uint64_t      min_keys, max_keys;
+    uint64_t      max_keys;
 
     tree = node->tree;
-    min_keys = bt_get_min_keys(tree);
     max_keys = bt_get_max_keys(tree);
 
     assert(bt_node_get_key_count(node) == max_keys + 1);
@@ -764,474 +1294,3543 @@ static BTreeNode *bt_node_cut(BTreeNode *node, uint64_t *split_key)
     }
 
     new = bt_node_new_empty(tree, type);
-    *split_key = bt_node_get_key(node, min_keys);
-    // not link internal node in same layer?
-    //if(bt_node_get_type(node) & BT_NODE_TYPE_LEAF)
-    //{
+    *split_key = bt_node_get_key(node, split);
+    // not link internal node in same layer, nobody walks them.
+    // so internal split doesn't dirty its right sibling.
+    if(type & BT_NODE_TYPE_LEAF)
+    {
         bt_node_link_sibling(new, bt_node_get_right_sibling(node));
         bt_node_link_sibling(node, new);
-    //}
-    bt_node_move_half_content(new, node, min_keys);
+    }
+    bt_node_move_half_content(new, node, split);
  
 
     bt_node_set_type(node, type);
     return new;
 }
 
-static void bt_node_none_leaf_insert(BTree * bt, BTreeNode *parent, BTreeNode *left, BTreeNode *new, uint64_t key);
-static void bt_node_none_leaf_split(BTree *bt, BTreeNode *node)
+static void bt_node_none_leaf_make_space(BTreeNode *node, uint64_t index)
 {
-    uint64_t      split_key;
-    uint64_t      type;
-    BTreeNode    *new;
-
-    assert(!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF));
-    assert(bt_node_get_key_count(node) == bt_get_max_keys(bt) + 1);
+    uint64_t *counts;
 
-    type = bt_node_get_type(node);
-    new = bt_node_cut(node, &split_key);
+    counts = bt_node_get_counts(node);
+    if (counts)
+        memmove(counts + index + 1, counts + index, (bt_node_get_key_count(node) - index + 1) * sizeof(uint64_t));
+    bt_node_blk_none_leaf_make_space(node->blk, index);
+}
+
+// left is the child at index of parent, it was just cut into left and new.
+static void bt_node_none_leaf_insert(BTreeNode *parent, uint64_t index, BTreeNode *left, BTreeNode *new, uint64_t key)
+{
+    assert(!(bt_node_get_type(parent) & BT_NODE_TYPE_LEAF));
+    assert(bt_node_get_key_count(parent) <= bt_get_max_keys(parent->tree));
+    assert(bt_node_blk_get_child_blkid(parent->blk, index) == left->blkid);
+
+    bt_node_none_leaf_make_space(parent, index);
+    bt_node_set_key_and_link(parent, index, key, left, new);
+    bt_node_set_key_count(parent, bt_node_get_key_count(parent) + 1);
+}
+
+// path to the rightmost leaf is kept pinned, inserts of keys after all
+// keys of the tree go there without descent. it is dropped before any split.
+static void bt_append_path_drop(BTree *bt)
+{
+    uint64_t i;
+
+    for (i = 0; i < bt->append_path.depth; i++)
+        bt_node_unpin(bt->append_path.steps[i].node);
+    bt->append_path.depth = 0;
+}
+
+// keep path if none is kept and it leads to the rightmost leaf. a path
+// taken before a split fails the check, the split changed its parent.
+static void bt_append_path_keep(BTree *bt, BTreePath *path)
+{
+    BTreeNode *node;
+    uint64_t   i;
 
-    if (type & BT_NODE_TYPE_ROOT)
+    if (bt->append_path.depth > 0 || path->steps[0].node != bt->root)
+        return;
+    for (i = 0; i + 1 < path->depth; i++)
     {
-        // Root(none leaft) split
-        bt_node_new_root_with_one_key(bt, split_key, node, new);
+        node = path->steps[i].node;
+        if (path->steps[i].index != bt_node_get_key_count(node) ||
+            bt_node_blk_get_child_blkid(node->blk, path->steps[i].index) != path->steps[i + 1].node->blkid)
+            return;
     }
-    else
-    {   
-        bt_node_none_leaf_insert(bt, bt_node_get_parent(node), node, new, split_key);
-        //bt_node_none_leaf_insert(bt, bt_node_get_parent(node), node, new, split_key);
+
+    for (i = 0; i < path->depth; i++)
+    {
+        bt->append_path.steps[i] = path->steps[i];
+        bt_node_pin(path->steps[i].node);
     }
+    bt->append_path.depth = path->depth;
 }
 
-static void bt_node_none_leaf_make_space(BTreeNode *node, uint64_t index)
+// copy the kept path to path if key goes to the rightmost leaf: it is
+// after the last key of the lowest none leaf node, the largest one of the
+// rightmost path.
+static int bt_append_path_match(BTree *bt, uint64_t key, BTreePath *path)
 {
-    bt_node_blk_none_leaf_make_space(node->blk, index);
+    BTreeNode *parent;
+    uint64_t   depth;
+
+    depth = bt->append_path.depth;
+    if (depth == 0)
+        return 0;
+    if (depth > 1)
+    {
+        parent = bt->append_path.steps[depth - 2].node;
+        if (key <= bt_node_get_key(parent, bt_node_get_key_count(parent) - 1))
+            return 0;
+    }
+    memcpy(path->steps, bt->append_path.steps, depth * sizeof(path->steps[0]));
+    path->depth = depth;
+    return 1;
 }
 
-static void bt_node_none_leaf_insert(BTree * bt, BTreeNode *parent, BTreeNode *left, BTreeNode *new, uint64_t key)
+// n pairs were inserted into the leaf at the end of path, or removed if n
+// is negative. counts of each none leaf node on path are changed by n.
+static void bt_path_add_count(BTree *bt, BTreePath *path, int64_t n)
 {
-    uint64_t index;
+    BTreeNode *node;
+    uint64_t   i;
 
-    assert(parent);
-    assert(!(bt_node_get_type(parent) & BT_NODE_TYPE_LEAF));
-    assert(bt_node_get_key_count(parent) <= bt_get_max_keys(bt) + 1);
+    if (!bt_meta_is_counted(bt->meta))
+        return;
+    for (i = 0; i + 1 < path->depth; i++)
+    {
+        node = path->steps[i].node;
+        bt_node_get_counts(node)[path->steps[i].index] += n;
+        bt_node_marked_dirty(node);
+    }
+}
 
-    index = bt_node_get_child_index(parent, left);
-    bt_node_none_leaf_make_space(parent, index);
-    bt_node_set_key_and_link(parent, index, key, left, new);
-    bt_node_set_key_count(parent, bt_node_get_key_count(parent) + 1);
-    if (bt_node_get_key_count(parent) > bt_get_max_keys(bt))
-        bt_node_none_leaf_split(bt, parent);
+// node at level of path is overfull, split it and insert split key into
+// parent, climb up the path while parent become overfull.
+// append is set if the key inserted is after all keys of the leaf. then a
+// node on the right edge of tree is cut near its end instead of in half,
+// it stays full and the new node takes following appends.
+static void bt_path_split(BTree *bt, BTreePath *path, uint64_t level, int append)
+{
+    uint64_t      i, split, split_key;
+    BTreeNode    *node;
+    BTreeNode    *parent;
+    BTreeNode    *new;
 
-    bt_node_marked_dirty(left);
-    bt_node_marked_dirty(new);
-    bt_node_marked_dirty(parent);
+    // nodes on the rightmost path are going to change
+    bt_append_path_drop(bt);
+
+    // only the rightmost node of each level is cut unevenly
+    for (i = 0; i < level; i++)
+        append = append && path->steps[i].index == bt_node_get_key_count(path->steps[i].node);
+
+    node = path->steps[level].node;
+    while (bt_node_get_key_count(node) > bt_get_max_keys(bt))
+    {
+        split = append ? bt_get_max_keys(bt) - 1 : bt_get_min_keys(bt);
+        new = bt_node_cut(node, split, &split_key);
+        if (level == 0)
+        {
+            // root split
+            bt_node_new_root_with_one_key(bt, split_key, node, new);
+            return;
+        }
+
+        level--;
+        parent = path->steps[level].node;
+        bt_node_none_leaf_insert(parent, path->steps[level].index, node, new, split_key);
+        node = parent;
+    }
 }
 
-static void bt_node_leaf_split(BTreeNode *node)
+// insert a key,value pair into the LEAF node at the end of path
+static void bt_path_leaf_insert(BTree *bt, BTreePath *path, uint64_t key, uint64_t value)
 {
-    uint64_t      split_key;
-    uint64_t      type;
-    BTreeNode    *new;
+    BTreeNode *leaf;
+    uint64_t   count;
+    int        append;
 
-    assert(bt_node_get_type(node) & BT_NODE_TYPE_LEAF);
-    assert(bt_get_max_keys(node->tree) + 1 == bt_node_get_key_count(node));
-    
-    type = bt_node_get_type(node);
-    new = bt_node_cut(node, &split_key);
+    leaf = path->steps[path->depth - 1].node;
+    count = bt_node_get_key_count(leaf);
+    append = count == 0 || key > bt_node_get_key(leaf, count - 1);
+    bt_node_marked_dirty(leaf);
+    bt_node_blk_leaf_insert(leaf->blk, key, value);
+    bt_path_add_count(bt, path, 1);
+    if(bt_node_get_key_count(leaf) > bt_get_max_keys(bt))
+    {
+        // The bucket is overfull, split it.
+        bt_path_split(bt, path, path->depth - 1, append);
+    }
+}
+
+// node is no longer in tree, its block heads the free list
+static void bt_node_free(BTreeNode *node)
+{
+    BTree *bt;
+
+    bt = node->tree;
+    bt_node_blk_init(node->blk, bt_get_blksize(bt), bt_get_order(bt), BT_NODE_TYPE_FREE);
+    node->blk->right_sibling_blkid = bt_meta_get_free_blkid(bt->meta);
+    bt_meta_push_free_blkid(bt->meta, node->blkid);
+    bt_node_marked_dirty(node);
+}
+
+// move the last entry of left to the front of right, they are children at
+// sep and sep + 1 of parent.
+static void bt_node_rotate_right(BTreeNode *parent, uint64_t sep, BTreeNode *left, BTreeNode *right)
+{
+    uint64_t *lkeys, *lslots, *rkeys, *rslots;
+    uint64_t *lcounts, *rcounts, *counts;
+    uint64_t  lc, rc, moved;
+
+    lkeys = bt_node_blk_keys(left->blk);
+    lslots = bt_node_blk_slots(left->blk);
+    rkeys = bt_node_blk_keys(right->blk);
+    rslots = bt_node_blk_slots(right->blk);
+    lc = bt_node_get_key_count(left);
+    rc = bt_node_get_key_count(right);
+    moved = 1;
+
+    if (bt_node_get_type(left) & BT_NODE_TYPE_LEAF)
+    {
+        memmove(rkeys + 1, rkeys, rc * sizeof(uint64_t));
+        memmove(rslots + 1, rslots, rc * sizeof(uint64_t));
+        rkeys[0] = lkeys[lc - 1];
+        rslots[0] = lslots[lc - 1];
+        bt_node_set_key(parent, sep, lkeys[lc - 2]);
+    }
+    else
+    {
+        // separator comes down, last key of left goes up
+        memmove(rkeys + 1, rkeys, rc * sizeof(uint64_t));
+        memmove(rslots + 1, rslots, (rc + 1) * sizeof(uint64_t));
+        rkeys[0] = bt_node_get_key(parent, sep);
+        rslots[0] = lslots[lc];
+        bt_node_set_key(parent, sep, lkeys[lc - 1]);
+        lcounts = bt_node_get_counts(left);
+        rcounts = bt_node_get_counts(right);
+        if (lcounts)
+        {
+            memmove(rcounts + 1, rcounts, (rc + 1) * sizeof(uint64_t));
+            rcounts[0] = lcounts[lc];
+            moved = lcounts[lc];
+        }
+    }
+    bt_node_set_key_count(left, lc - 1);
+    bt_node_set_key_count(right, rc + 1);
+
+    counts = bt_node_get_counts(parent);
+    if (counts)
+    {
+        counts[sep] -= moved;
+        counts[sep + 1] += moved;
+    }
+}
 
-    if (type & BT_NODE_TYPE_ROOT)
+// move the first entry of right to the end of left
+static void bt_node_rotate_left(BTreeNode *parent, uint64_t sep, BTreeNode *left, BTreeNode *right)
+{
+    uint64_t *lkeys, *lslots, *rkeys, *rslots;
+    uint64_t *lcounts, *rcounts, *counts;
+    uint64_t  lc, rc, moved;
+
+    lkeys = bt_node_blk_keys(left->blk);
+    lslots = bt_node_blk_slots(left->blk);
+    rkeys = bt_node_blk_keys(right->blk);
+    rslots = bt_node_blk_slots(right->blk);
+    lc = bt_node_get_key_count(left);
+    rc = bt_node_get_key_count(right);
+    moved = 1;
+
+    if (bt_node_get_type(left) & BT_NODE_TYPE_LEAF)
     {
-        // Root is the only leaf node
-        bt_node_new_root_with_one_key(node->tree, split_key, node, new);
+        lkeys[lc] = rkeys[0];
+        lslots[lc] = rslots[0];
+        bt_node_set_key(parent, sep, rkeys[0]);
+        memmove(rkeys, rkeys + 1, (rc - 1) * sizeof(uint64_t));
+        memmove(rslots, rslots + 1, (rc - 1) * sizeof(uint64_t));
     }
     else
     {
-        bt_node_none_leaf_insert(node->tree, bt_node_get_parent(node), node, new, split_key);
-    } 
+        lkeys[lc] = bt_node_get_key(parent, sep);
+        lslots[lc + 1] = rslots[0];
+        bt_node_set_key(parent, sep, rkeys[0]);
+        memmove(rkeys, rkeys + 1, (rc - 1) * sizeof(uint64_t));
+        memmove(rslots, rslots + 1, rc * sizeof(uint64_t));
+        lcounts = bt_node_get_counts(left);
+        rcounts = bt_node_get_counts(right);
+        if (lcounts)
+        {
+            moved = rcounts[0];
+            lcounts[lc + 1] = rcounts[0];
+            memmove(rcounts, rcounts + 1, rc * sizeof(uint64_t));
+        }
+    }
+    bt_node_set_key_count(left, lc + 1);
+    bt_node_set_key_count(right, rc - 1);
+
+    counts = bt_node_get_counts(parent);
+    if (counts)
+    {
+        counts[sep] += moved;
+        counts[sep + 1] -= moved;
+    }
 }
-// insert a key,value pair into a LEAF node
-static void bt_node_leaf_insert(BTreeNode *leaf, uint64_t key, uint64_t value)
+
+// append right to left and free right, separator sep of parent between
+// them is removed. for none leaf nodes it comes down between their keys.
+static void bt_node_merge(BTreeNode *parent, uint64_t sep, BTreeNode *left, BTreeNode *right)
 {
-    bt_node_marked_dirty(leaf);
-    bt_node_blk_leaf_insert(leaf->blk, key, value);    
-    if(bt_node_get_key_count(leaf) > bt_get_max_keys(leaf->tree))
+    BTreeNode *next;
+    uint64_t   lc, rc;
+    uint64_t  *counts;
+
+    lc = bt_node_get_key_count(left);
+    rc = bt_node_get_key_count(right);
+    if (bt_node_get_type(left) & BT_NODE_TYPE_LEAF)
+    {
+        memcpy(bt_node_blk_keys(left->blk) + lc, bt_node_blk_keys(right->blk), rc * sizeof(uint64_t));
+        memcpy(bt_node_blk_slots(left->blk) + lc, bt_node_blk_slots(right->blk), rc * sizeof(uint64_t));
+        bt_node_set_key_count(left, lc + rc);
+        // right of right, if any, links left now
+        next = bt_node_get_right_sibling(right);
+        if (next)
+            bt_node_link_sibling(left, next);
+        else
+            left->blk->right_sibling_blkid = 0;
+    }
+    else
     {
-        // The bucket is full, do split before insert.
-        bt_node_leaf_split(leaf);
+        bt_node_set_key(left, lc, bt_node_get_key(parent, sep));
+        memcpy(bt_node_blk_keys(left->blk) + lc + 1, bt_node_blk_keys(right->blk), rc * sizeof(uint64_t));
+        memcpy(bt_node_blk_slots(left->blk) + lc + 1, bt_node_blk_slots(right->blk), (rc + 1) * sizeof(uint64_t));
+        counts = bt_node_get_counts(left);
+        if (counts)
+            memcpy(counts + lc + 1, bt_node_get_counts(right), (rc + 1) * sizeof(uint64_t));
+        bt_node_set_key_count(left, lc + 1 + rc);
     }
+
+    bt_node_marked_dirty(parent);
+    counts = bt_node_get_counts(parent);
+    if (counts)
+    {
+        counts[sep] += counts[sep + 1];
+        memmove(counts + sep + 1, counts + sep + 2, (bt_node_get_key_count(parent) - sep - 1) * sizeof(uint64_t));
+    }
+    bt_node_blk_none_leaf_remove(parent->blk, sep);
+    bt_node_free(right);
 }
 
-// given a node, return the leaf derived from node that should contain key
-static BTreeNode *bt_node_search(BTreeNode *node, uint64_t key)
+// node at level of path has less than min_keys, take keys from a sibling
+// or merge with it, and climb up the path while parent becomes underfull.
+// root with a single child is replaced by the child.
+static void bt_path_rebalance(BTree *bt, BTreePath *path, uint64_t level)
 {
-    uint64_t i, key_count;
+    BTreeNode *node, *parent, *left, *right;
+    uint64_t   index, sep, total;
 
-    if(bt_node_get_type(node) & BT_NODE_TYPE_LEAF)
-        return node;
+    node = path->steps[level].node;
+    if (level > 0 && bt_node_get_key_count(node) >= bt_get_min_keys(bt))
+        return;
+    // nodes on the rightmost path may change
+    bt_append_path_drop(bt);
 
-    key_count = bt_node_get_key_count(node);
-    for(i = 0; i < key_count; i++)
+    while (level > 0 && bt_node_get_key_count(node) < bt_get_min_keys(bt))
     {
-        if (key <= bt_node_get_key(node, i))
+        level--;
+        parent = path->steps[level].node;
+        index = path->steps[level].index;
+        // the left sibling if there is one, otherwise the right one
+        if (index > 0)
+        {
+            sep = index - 1;
+            left = bt_node_get_child(parent, sep);
+            right = node;
+        }
+        else
+        {
+            sep = index;
+            left = node;
+            right = bt_node_get_child(parent, sep + 1);
+        }
+
+        total = bt_node_get_key_count(left) + bt_node_get_key_count(right);
+        if (!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+            total++;
+        if (total <= bt_get_max_keys(bt))
         {
-            return bt_node_search(bt_node_get_child(node, i), key);
+            bt_node_merge(parent, sep, left, right);
         }
+        else
+        {
+            // more than max_keys in two, both keep min_keys at least
+            while (bt_node_get_key_count(left) < bt_get_min_keys(bt))
+                bt_node_rotate_left(parent, sep, left, right);
+            while (bt_node_get_key_count(right) < bt_get_min_keys(bt))
+                bt_node_rotate_right(parent, sep, left, right);
+        }
+        node = parent;
+    }
+
+    if (level == 0 && !(bt_node_get_type(node) & BT_NODE_TYPE_LEAF) && bt_node_get_key_count(node) == 0)
+    {
+        parent = node;
+        node = bt_node_get_child(parent, 0);
+        bt_node_set_type(node, bt_node_get_type(node) & BT_NODE_TYPE_LEAF ? BT_NODE_TYPE_LEAF | BT_NODE_TYPE_ROOT : BT_NODE_TYPE_ROOT);
+        bt_set_root(bt, node);
+        bt_set_root_blkid(bt, node->blkid);
+        bt_node_free(parent);
     }
-    return bt_node_search(bt_node_get_child(node, i), key);
 }
 
-// return 1 iff the caller need to check next sibling elss 0
-// thai is          #keys_put_in_to_value < limit && 
-//                  last key in this node has key = key
-int bt_node_leaf_fetch_values(BTreeNode *leaf, BTreeValues *values, uint64_t limit, uint64_t key_min, uint64_t key_max)
+// move path to the leaf right to its leaf, return 0 if there is none
+static int bt_path_next_leaf(BTreePath *path)
 {
-    uint64_t count;
-    uint64_t index;
-    uint64_t keys_in_node;
-    uint64_t k, v;
+    BTreeNode *node;
+    uint64_t   level;
 
-    count = 0;
-    keys_in_node = bt_node_blk_get_key_count(leaf->blk);
+    // lowest node having a child right to the path
+    level = path->depth - 1;
+    while (level > 0 && path->steps[level - 1].index == bt_node_get_key_count(path->steps[level - 1].node))
+        level--;
+    if (level == 0)
+        return 0;
 
-    // empty tree!
-    if(keys_in_node == 0)
+    path->steps[level - 1].index++;
+    node = bt_node_get_child(path->steps[level - 1].node, path->steps[level - 1].index);
+    for (; level < path->depth; level++)
     {
-        assert(bt_node_get_type(leaf) & BT_NODE_TYPE_ROOT);
-        return 0;
+        path->steps[level].node = node;
+        path->steps[level].index = 0;
+        if (level + 1 < path->depth)
+            node = bt_node_get_child(node, 0);
     }
+    return 1;
+}
 
-    index = bt_node_blk_leaf_search(leaf->blk, key_min);
+// count leading pairs of sorted pairs[n] that go to the leaf at the end of
+// path: keys up to the smallest separator right to the path.
+static uint64_t bt_path_count_run(BTreePath *path, const BTreePair *pairs, uint64_t n)
+{
+    BTreeNode *node;
+    uint64_t   i, bound, lo, hi, mid;
+    int        bounded;
 
-    for(; index < keys_in_node; index ++)
+    bounded = 0;
+    bound = 0;
+    for (i = 0; i + 1 < path->depth; i++)
     {
-        k = bt_node_blk_get_key(leaf->blk, index);
-        if(k > key_max)
-            break;
-        v = bt_node_blk_get_value(leaf->blk, index);
-        bt_values_put_value(values, v);
+        node = path->steps[i].node;
+        if (path->steps[i].index < bt_node_get_key_count(node) &&
+            (!bounded || bt_node_get_key(node, path->steps[i].index) < bound))
+        {
+            bound = bt_node_get_key(node, path->steps[i].index);
+            bounded = 1;
+        }
+    }
+    if (!bounded)
+        return n;
 
-        count ++;
-        if(count == limit)
-            break;
+    // first pair whose key > bound
+    lo = 0;
+    hi = n;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (pairs[mid].key <= bound)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    if((index == keys_in_node) && (count < limit))
-        return 1;
+// level of path that key still goes through: path was taken for a smaller
+// key, key goes to the same child until a separator it is after.
+static uint64_t bt_path_shared_level(BTreePath *path, uint64_t key)
+{
+    BTreeNode *node;
+    uint64_t   i;
+
+    for (i = 0; i + 1 < path->depth; i++)
+    {
+        node = path->steps[i].node;
+        if (path->steps[i].index < bt_node_get_key_count(node) &&
+            key > bt_node_get_key(node, path->steps[i].index))
+            return i;
+    }
+    return path->depth - 1;
+}
+
+// move path to the leaf of key, from root if path is empty. otherwise key
+// is after keys path was taken for, nodes shared by both are not searched
+// again. nodes on path are pinned, see bt_path_release.
+static void bt_path_seek(BTree *bt, BTreePath *path, uint64_t key)
+{
+    BTreeNode *node;
+    uint64_t   level, i;
+
+    if (path->depth == 0)
+    {
+        level = 0;
+        node = bt->root;
+        bt_node_pin(node);
+        path->steps[0].node = node;
+    }
+    else
+    {
+        level = bt_path_shared_level(path, key);
+        for (i = level + 1; i < path->depth; i++)
+            bt_node_unpin(path->steps[i].node);
+        node = path->steps[level].node;
+    }
+
+    while (!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+    {
+        i = bt_node_blk_none_leaf_search(node->blk, key);
+        path->steps[level].index = i;
+        node = bt_node_get_child(node, i);
+        bt_node_pin(node);
+        level++;
+        assert(level < BT_MAX_HEIGHT);
+        path->steps[level].node = node;
+    }
+    path->steps[level].index = 0;
+    path->depth = level + 1;
+}
+
+static void bt_path_release(BTreePath *path)
+{
+    uint64_t i;
+
+    for (i = 0; i < path->depth; i++)
+        bt_node_unpin(path->steps[i].node);
+    path->depth = 0;
+}
+
+// return the leaf that should contain key.
+// if path is not NULL, record nodes from root to leaf, and the child index
+// taken at each none leaf node.
+static BTreeNode *bt_search_leaf(BTree *bt, uint64_t key, BTreePath *path)
+{
+    BTreeNode *node;
+    uint64_t   i, depth;
+
+    node = bt->root;
+    depth = 0;
+    while (!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+    {
+        // first child whose key >= key, the last child if no such key
+        i = bt_node_blk_none_leaf_search(node->blk, key);
+        if (path)
+        {
+            assert(depth < BT_MAX_HEIGHT);
+            path->steps[depth].node = node;
+            path->steps[depth].index = i;
+        }
+        depth++;
+        node = bt_node_get_child(node, i);
+    }
+
+    if (path)
+    {
+        assert(depth < BT_MAX_HEIGHT);
+        path->steps[depth].node = node;
+        path->steps[depth].index = 0;
+        path->depth = depth + 1;
+    }
+    return node;
+}
+
+// leaves read ahead by a range scan at most
+#define BT_PREFETCH_LEAVES 16
+
+// a scan is going to read the right sibling of leaf from file, or the left
+// one if left. read it together with following leaves under the same parent
+// instead. depth is the height of tree, leaves are at depth - 1.
+static void bt_path_prefetch_leaves(BTree *bt, BTreeNode *leaf, uint64_t depth, int left)
+{
+    BTreeNode *node;
+    uint64_t   blkids[BT_PREFETCH_LEAVES];
+    uint64_t   key, level, i, n, window;
+
+    window = BT_PREFETCH_LEAVES;
+    // don't let read ahead push out most of a small pool
+    if (bt->pool->capacity && bt->pool->capacity / 4 / bt->slab->frame_size < window)
+        window = bt->pool->capacity / 4 / bt->slab->frame_size;
+    if (window < 2 || depth < 2 || bt_node_get_key_count(leaf) == 0)
+        return;
+
+    if (left)
+    {
+        // first leaf may having the first key of leaf, it is leaf itself
+        // unless equal keys go on from left
+        key = bt_node_get_key(leaf, 0);
+    }
     else
+    {
+        // first leaf with a key greater than the last one in leaf
+        key = bt_node_get_key(leaf, bt_node_get_key_count(leaf) - 1);
+        if (key == UINT64_MAX)
+            return;
+        key++;
+    }
+
+    // stop at the parent of leaves, don't load the leaf alone
+    node = bt->root;
+    for (level = 0; level + 2 < depth; level++)
+        node = bt_node_get_child(node, bt_node_blk_none_leaf_search(node->blk, key));
+    i = bt_node_blk_none_leaf_search(node->blk, key);
+
+    // leaves in memory, leaf itself among them, are skipped
+    n = 0;
+    while (i <= bt_node_get_key_count(node) && n < window)
+    {
+        blkids[n] = bt_node_blk_get_child_blkid(node->blk, i);
+        if (bt_node_table_get(&bt->nodes, blkids[n]) == NULL)
+            n++;
+        if (left && i == 0)
+            break;
+        i = left ? i - 1 : i + 1;
+    }
+    if (n > 1)
+        bt_node_load_batch(bt, blkids, n);
+}
+
+// pairs of keys less than key in a counted tree: all under children left
+// to the search path, and those before key in its leaf.
+static uint64_t bt_count_less(BTree *bt, uint64_t key)
+{
+    BTreeNode *node;
+    uint64_t  *counts;
+    uint64_t   i, index, rank;
+
+    rank = 0;
+    node = bt->root;
+    while (!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+    {
+        index = bt_node_blk_none_leaf_search(node->blk, key);
+        counts = bt_node_get_counts(node);
+        for (i = 0; i < index; i++)
+            rank += counts[i];
+        node = bt_node_get_child(node, index);
+    }
+    return rank + bt_node_blk_leaf_search(node->blk, key);
+}
+
+// copy values of keys in [key_min, key_max] in leaf to out, at most limit
+// of them, out may be NULL to count them only. return number copied, *more
+// is 1 iff all matched keys till the end of leaf are copied, the next leaf
+// may have more.
+static uint64_t bt_node_leaf_fetch(BTreeNode *leaf, uint64_t *out, uint64_t limit,
+                                   uint64_t key_min, uint64_t key_max, int *more)
+{
+    uint64_t  keys_in_node;
+    uint64_t  index, end, n;
+
+    *more = 0;
+    keys_in_node = bt_node_blk_get_key_count(leaf->blk);
+
+    // empty tree!
+    if(keys_in_node == 0)
+    {
+        assert(bt_node_get_type(leaf) & BT_NODE_TYPE_ROOT);
         return 0;
+    }
+
+    // matched keys are a run, copied at once
+    index = bt_node_blk_leaf_search(leaf->blk, key_min);
+    if (key_max == UINT64_MAX)
+        end = keys_in_node;
+    else
+        end = bt_node_blk_leaf_search(leaf->blk, key_max + 1);
+    n = end > index ? end - index : 0;
+    if (n > limit)
+        n = limit;
+    if (out)
+        memcpy(out, bt_node_blk_slots(leaf->blk) + index, n * sizeof(uint64_t));
+
+    *more = index + n == keys_in_node && n < limit;
+    return n;
 }
 
 static void bt_node_destory(BTreeNode *node)
 {
-    bt_node_blk_destory(node->blk);
-    free(node);
+    bt_pool_remove(node->tree->pool, node);
+    bt_slab_free(node->tree->slab, node);
+}
+
+// write back if needed and drop node from memory.
+// blocks on disk must stay as of the last checkpoint: written in place, a
+// modified node would mix into it and a crash leaves neither tree. so a
+// modified node is kept until a checkpoint, unless shadow paging writes
+// it aside.
+static int bt_node_evictable(BTreeNode *node)
+{
+    return node->state == NULL || node->tree->shadow;
+}
+
+static void bt_node_evict(BTreeNode *node)
+{
+    BTree *bt;
+
+    bt = node->tree;
+    assert(node->pins == 0);
+    if (node->state != NULL)
+    {
+        // see bt_node_evictable, dirty nodes are kept without shadow
+        assert(bt->shadow);
+        bt_node_write_back(node);
+        bt->pool->write_backs++;
+    }
+    bt_unset_node(bt, node->blkid);
+    bt_node_destory(node);
 }
 
 
 
 
 /////////////////////////////////////////////////
-//  BTreeValues(result for search in tree)
+//  BTreeNodeTable
 /////////////////////////////////////////////////
-struct _BTreeValues
+
+#define BT_NODE_TABLE_MIN_SIZE 16
+
+static void bt_node_table_init(BTreeNodeTable *table, uint64_t size)
 {
-    uint64_t  counts;
-    uint64_t *values;
-};
+    table->size = size;
+    table->count = 0;
+    table->slots = (BTreeNode **)malloc(sizeof(BTreeNode *) * size);
+    memset(table->slots, 0, sizeof(BTreeNode *) * size);
+}
 
-static BTreeValues *bt_values_new()
+static void bt_node_table_destory(BTreeNodeTable *table)
 {
-    BTreeValues *values;
-    values = (BTreeValues *)malloc(sizeof(BTreeValues));
+    free(table->slots);
+}
 
-    values->counts = 0;
-    values->values = NULL;
+static uint64_t bt_node_table_hash(BTreeNodeTable *table, uint64_t blkid)
+{
+    // fibonacci hashing, nearby blkids spread over the table
+    return (blkid * 0x9e3779b97f4a7c15ULL) & (table->size - 1);
+}
 
-    return values;
+static BTreeNode *bt_node_table_get(BTreeNodeTable *table, uint64_t blkid)
+{
+    uint64_t i;
+
+    for (i = bt_node_table_hash(table, blkid); table->slots[i]; i = (i + 1) & (table->size - 1))
+    {
+        if (table->slots[i]->blkid == blkid)
+            return table->slots[i];
+    }
+    return NULL;
 }
 
-void bt_values_destory(BTreeValues *values)
+static void bt_node_table_put(BTreeNodeTable *table, BTreeNode *node);
+
+static void bt_node_table_resize(BTreeNodeTable *table, uint64_t size)
 {
-    free(values->values);
-    free(values);
+    BTreeNodeTable  old;
+    uint64_t        i;
+
+    old = *table;
+    bt_node_table_init(table, size);
+    for (i = 0; i < old.size; i++)
+    {
+        if (old.slots[i])
+            bt_node_table_put(table, old.slots[i]);
+    }
+    bt_node_table_destory(&old);
 }
 
-uint64_t bt_values_get_count(BTreeValues *values)
+static void bt_node_table_put(BTreeNodeTable *table, BTreeNode *node)
 {
-    return values->counts;
+    uint64_t i;
+
+    // keep load factor under 3/4
+    if ((table->count + 1) * 4 > table->size * 3)
+        bt_node_table_resize(table, table->size * 2);
+
+    for (i = bt_node_table_hash(table, node->blkid); table->slots[i]; i = (i + 1) & (table->size - 1))
+        assert(table->slots[i]->blkid != node->blkid);
+    table->slots[i] = node;
+    table->count++;
+}
+
+static void bt_node_table_remove(BTreeNodeTable *table, uint64_t blkid)
+{
+    uint64_t    i, j, home, mask;
+
+    mask = table->size - 1;
+    for (i = bt_node_table_hash(table, blkid); table->slots[i]->blkid != blkid; i = (i + 1) & mask)
+        ;   // must be in table
+
+    // shift back following nodes of the cluster which can't be found
+    // once slot i is empty, no tombstone needed.
+    table->slots[i] = NULL;
+    for (j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask)
+    {
+        home = bt_node_table_hash(table, table->slots[j]->blkid);
+        // home cyclically in (i, j] means slots[j] is still reachable
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        table->slots[i] = table->slots[j];
+        table->slots[j] = NULL;
+        i = j;
+    }
+    table->count--;
+
+    // shrink as nodes are evicted
+    if (table->size > BT_NODE_TABLE_MIN_SIZE && table->count * 8 < table->size)
+        bt_node_table_resize(table, table->size / 2);
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeSlab
+/////////////////////////////////////////////////
+
+#define BT_CACHE_LINE        64
+#define BT_PAGE_SIZE         4096
+#define BT_SLAB_CHUNK_SIZE   (64 * 1024)
+#define BT_SLAB_CHUNK_FRAMES 16         // at least, for large blocks
+
+#define BT_ROUND_UP(n, align) (((n) + (align) - 1) / (align) * (align))
+
+// node header padded to a cache line, blk starts on a cache line
+#define BT_NODE_HEADER_SIZE  BT_ROUND_UP(sizeof(BTreeNode), BT_CACHE_LINE)
+
+static uint64_t bt_node_frame_size(uint64_t blksize)
+{
+    return BT_NODE_HEADER_SIZE + BT_ROUND_UP(blksize, BT_CACHE_LINE);
+}
+
+static BTreeSlab *bt_slab_new(uint64_t frame_size)
+{
+    BTreeSlab *slab;
+
+    assert(frame_size % BT_CACHE_LINE == 0);
+    slab = (BTreeSlab *)malloc(sizeof(BTreeSlab));
+    slab->frame_size = frame_size;
+    slab->chunk_size = BT_SLAB_CHUNK_SIZE;
+    if (slab->chunk_size < frame_size * BT_SLAB_CHUNK_FRAMES)
+        slab->chunk_size = BT_ROUND_UP(frame_size * BT_SLAB_CHUNK_FRAMES, BT_PAGE_SIZE);
+    slab->free_frames = NULL;
+    slab->chunks = NULL;
+    slab->next = NULL;
+
+    return slab;
+}
+
+// release all chunks at once, frames in use are gone too.
+static void bt_slab_destory(BTreeSlab *slab)
+{
+    void *chunk;
+
+    while (slab->chunks)
+    {
+        chunk = slab->chunks;
+        slab->chunks = *(void **)chunk;
+        free(chunk);
+    }
+    free(slab);
+}
+
+// cut a new chunk into frames, first cache line of chunk links chunks
+static void bt_slab_grow(BTreeSlab *slab)
+{
+    char     *chunk;
+    char     *frame;
+    int       rtv;
+
+    rtv = posix_memalign((void **)&chunk, BT_PAGE_SIZE, slab->chunk_size);
+    assert(rtv == 0);
+    *(void **)chunk = slab->chunks;
+    slab->chunks = chunk;
+
+    for (frame = chunk + BT_CACHE_LINE;
+         frame + slab->frame_size <= chunk + slab->chunk_size;
+         frame += slab->frame_size)
+    {
+        *(void **)frame = slab->free_frames;
+        slab->free_frames = frame;
+    }
+}
+
+static void *bt_slab_alloc(BTreeSlab *slab)
+{
+    void *frame;
+
+    if (slab->free_frames == NULL)
+        bt_slab_grow(slab);
+    frame = slab->free_frames;
+    slab->free_frames = *(void **)frame;
+
+    return frame;
+}
+
+static void bt_slab_free(BTreeSlab *slab, void *frame)
+{
+    *(void **)frame = slab->free_frames;
+    slab->free_frames = frame;
+}
+
+// node and blk are in one frame
+static BTreeNode *bt_node_alloc(BTree *bt)
+{
+    BTreeNode *node;
+
+    node = (BTreeNode *)bt_slab_alloc(bt->slab);
+    node->blk = (BTreeNodeBlk *)((char *)node + BT_NODE_HEADER_SIZE);
+
+    return node;
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreePool
+/////////////////////////////////////////////////
+
+// Nodes are loaded into the pool on first access. When memory of nodes
+// exceeds capacity, nodes are evicted in CLOCK (second chance) order:
+// a node accessed since the hand passed gets one more round, dirty node is
+// written back before it's dropped.
+// Eviction only happens in bt_pool_balance, which is called where no node
+// pointer is held by the operation except pinned ones.
+// A pool may be shared by several trees, a hot tree takes memory from cold
+// ones. Operations on trees sharing a pool must not run concurrently.
+
+BTreePool *bt_pool_new(uint64_t capacity)
+{
+    BTreePool *pool;
+
+    pool = (BTreePool *)malloc(sizeof(BTreePool));
+    memset(pool, 0, sizeof(BTreePool));
+    pool->capacity = capacity;
+    INIT_LIST_HEAD(&pool->clock);
+
+    return pool;
+}
+
+// free memory of all nodes in bulk, nodes still in pool are gone.
+static void bt_pool_release(BTreePool *pool)
+{
+    BTreeSlab *slab;
+
+    while (pool->slabs)
+    {
+        slab = pool->slabs;
+        pool->slabs = slab->next;
+        bt_slab_destory(slab);
+    }
+    if (pool->io)
+        bt_io_destory(pool->io);
+    free(pool);
+}
+
+void bt_pool_destory(BTreePool *pool)
+{
+    // trees using the pool should be closed before
+    assert(list_empty(&pool->clock));
+    bt_pool_release(pool);
+}
+
+// trees with same block size share a slab
+static BTreeSlab *bt_pool_get_slab(BTreePool *pool, uint64_t frame_size)
+{
+    BTreeSlab *slab;
+
+    for (slab = pool->slabs; slab; slab = slab->next)
+    {
+        if (slab->frame_size == frame_size)
+            return slab;
+    }
+    slab = bt_slab_new(frame_size);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    return slab;
+}
+
+static uint64_t bt_node_mem_size(BTreeNode *node)
+{
+    return node->tree->slab->frame_size;
+}
+
+static void bt_pool_add(BTreePool *pool, BTreeNode *node)
+{
+    node->referenced = 1;
+    list_add_tail(&node->pool_chain, &pool->clock);
+    pool->used += bt_node_mem_size(node);
+    pool->nodes++;
+}
+
+static void bt_pool_remove(BTreePool *pool, BTreeNode *node)
+{
+    list_del(&node->pool_chain);
+    pool->used -= bt_node_mem_size(node);
+    pool->nodes--;
+}
+
+static void bt_pool_hit(BTreePool *pool, BTreeNode *node)
+{
+    node->referenced = 1;
+    pool->hits++;
+}
+
+// evict nodes until memory used is within capacity, or every node left
+// is pinned.
+static void bt_pool_balance(BTreePool *pool)
+{
+    BTreeNode *node;
+    uint64_t   visits;
+
+    if (pool->capacity == 0)
+        return;
+
+    // two rounds clear all reference bits, nothing evictable is left after
+    visits = pool->nodes * 2;
+    while (pool->used > pool->capacity && visits > 0)
+    {
+        visits--;
+        node = list_entry(pool->clock.next, BTreeNode, pool_chain);
+        list_move_tail(&node->pool_chain, &pool->clock);
+
+        if (node->pins || !bt_node_evictable(node))
+            continue;
+        if (node->referenced)
+        {
+            node->referenced = 0;
+            continue;
+        }
+        bt_node_evict(node);
+        pool->evictions++;
+    }
+}
+
+void bt_pool_get_stat(BTreePool *pool, BTreeCacheStat *stat)
+{
+    stat->capacity = pool->capacity;
+    stat->used = pool->used;
+    stat->nodes = pool->nodes;
+    stat->hits = pool->hits;
+    stat->misses = pool->misses;
+    stat->evictions = pool->evictions;
+    stat->write_backs = pool->write_backs;
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeValues(result for search in tree)
+/////////////////////////////////////////////////
+struct _BTreeValues
+{
+    uint64_t  counts;
+    uint64_t  size;         // values allocated
+    uint64_t *values;
+};
+
+// values reserved by a search at first, more are allocated as found
+#define BT_VALUES_RESERVE_MAX   4096
+
+static BTreeValues *bt_values_new()
+{
+    BTreeValues *values;
+    values = (BTreeValues *)malloc(sizeof(BTreeValues));
+
+    values->counts = 0;
+    values->size = 0;
+    values->values = NULL;
+
+    return values;
+}
+
+void bt_values_destory(BTreeValues *values)
+{
+    free(values->values);
+    free(values);
+}
+
+uint64_t bt_values_get_count(BTreeValues *values)
+{
+    return values->counts;
+}
+
+// room for at least n values, doubled each time so appending is linear
+static void bt_values_reserve(BTreeValues *values, uint64_t n)
+{
+    uint64_t size;
+
+    if (n <= values->size)
+        return;
+    size = values->size ? values->size : 16;
+    while (size < n)
+        size *= 2;
+    values->values = (uint64_t *)realloc(values->values, size * sizeof(uint64_t));
+    values->size = size;
+}
+
+uint64_t bt_values_get_value(BTreeValues *values, uint64_t index)
+{
+    assert(index < values->counts);
+    return values->values[index];
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeCursor(walk pairs in key order, either way)
+/////////////////////////////////////////////////
+
+struct _BTreeCursor
+{
+    BTree      *bt;
+    BTreeNode  *leaf;       // pinned, NULL past the last or first pair
+    uint64_t    index;      // of current pair in leaf
+    uint64_t    depth;      // height of tree, for read ahead
+};
+
+// return the leaf of the pair at rank in key order, pinned, and set its
+// index in leaf. NULL if there are not more pairs than rank.
+// a counted tree is descended by counts, others walk leaves from the first.
+// depth is set to the height of tree.
+static BTreeNode *bt_search_rank(BTree *bt, uint64_t rank, uint64_t *index, uint64_t *depth)
+{
+    BTreeNode *node, *next;
+    uint64_t  *counts;
+    uint64_t   i, count, right;
+
+    node = bt->root;
+    *depth = 1;
+    while (!(bt_node_get_type(node) & BT_NODE_TYPE_LEAF))
+    {
+        counts = bt_node_get_counts(node);
+        count = bt_node_get_key_count(node);
+        for (i = 0; counts && i < count && rank >= counts[i]; i++)
+            rank -= counts[i];
+        node = bt_node_get_child(node, i);
+        (*depth)++;
+    }
+
+    // a counted tree walks no leaves unless rank is past the last pair
+    bt_node_pin(node);
+    while (rank >= bt_node_get_key_count(node))
+    {
+        rank -= bt_node_get_key_count(node);
+        right = bt_node_blk_get_right_sibling_blkid(node->blk);
+        if (right && bt_node_table_get(&bt->nodes, right) == NULL)
+            bt_path_prefetch_leaves(bt, node, *depth, 0);
+        next = bt_node_get_right_sibling(node);
+        if (next)
+            bt_node_pin(next);
+        bt_node_unpin(node);
+        if (next == NULL)
+            return NULL;
+        node = next;
+        bt_pool_balance(bt->pool);
+    }
+    *index = rank;
+    return node;
+}
+
+BTreeCursor *bt_cursor_new(BTree *bt)
+{
+    BTreeCursor *cursor;
+
+    cursor = (BTreeCursor *)malloc(sizeof(BTreeCursor));
+    cursor->bt = bt;
+    cursor->leaf = NULL;
+    cursor->index = 0;
+    cursor->depth = 0;
+    return cursor;
+}
+
+// leave leaves with no pair left for the right sibling, only the current
+// one is held so a long walk doesn't grow the pool.
+static int bt_cursor_skip_leaves(BTreeCursor *cursor)
+{
+    BTree     *bt;
+    BTreeNode *next;
+    uint64_t   right;
+
+    bt = cursor->bt;
+    while (cursor->leaf && cursor->index == bt_node_get_key_count(cursor->leaf))
+    {
+        // next leaf is not in memory, read ahead some leaves at once
+        right = bt_node_blk_get_right_sibling_blkid(cursor->leaf->blk);
+        if (right && bt_node_table_get(&bt->nodes, right) == NULL)
+            bt_path_prefetch_leaves(bt, cursor->leaf, cursor->depth, 0);
+
+        next = bt_node_get_right_sibling(cursor->leaf);
+        if (next)
+            bt_node_pin(next);
+        bt_node_unpin(cursor->leaf);
+        cursor->leaf = next;
+        cursor->index = 0;
+        bt_pool_balance(bt->pool);
+    }
+    return cursor->leaf != NULL;
+}
+
+int bt_cursor_seek(BTreeCursor *cursor, uint64_t key)
+{
+    BTreePath  path;
+    BTreeNode *leaf;
+
+    if (cursor->leaf)
+        bt_node_unpin(cursor->leaf);
+    leaf = bt_search_leaf(cursor->bt, key, &path);
+    bt_node_pin(leaf);
+    cursor->leaf = leaf;
+    cursor->index = bt_node_blk_leaf_search(leaf->blk, key);
+    cursor->depth = path.depth;
+    // first key not less than key may be in next leaf
+    return bt_cursor_skip_leaves(cursor);
+}
+
+int bt_cursor_next(BTreeCursor *cursor)
+{
+    if (cursor->leaf == NULL)
+        return 0;
+    cursor->index++;
+    if (cursor->index < bt_node_get_key_count(cursor->leaf))
+        return 1;
+    return bt_cursor_skip_leaves(cursor);
+}
+
+// move to the last pair of the nearest left leaf having pairs, only the
+// current leaf is held.
+static int bt_cursor_skip_leaves_left(BTreeCursor *cursor)
+{
+    BTree     *bt;
+    BTreeNode *prev;
+    uint64_t   left;
+
+    bt = cursor->bt;
+    do
+    {
+        left = bt_node_blk_get_left_sibling_blkid(cursor->leaf->blk);
+        if (left && bt_node_table_get(&bt->nodes, left) == NULL)
+            bt_path_prefetch_leaves(bt, cursor->leaf, cursor->depth, 1);
+
+        prev = bt_node_get_left_sibling(cursor->leaf);
+        if (prev)
+            bt_node_pin(prev);
+        bt_node_unpin(cursor->leaf);
+        cursor->leaf = prev;
+        bt_pool_balance(bt->pool);
+    } while (cursor->leaf && bt_node_get_key_count(cursor->leaf) == 0);
+
+    if (cursor->leaf == NULL)
+        return 0;
+    cursor->index = bt_node_get_key_count(cursor->leaf) - 1;
+    return 1;
+}
+
+int bt_cursor_seek_last(BTreeCursor *cursor, uint64_t key)
+{
+    BTreePath  path;
+    BTreeNode *leaf, *next;
+    uint64_t   index;
+
+    if (cursor->leaf)
+        bt_node_unpin(cursor->leaf);
+
+    // all keys before the first one greater than key
+    if (key == UINT64_MAX)
+    {
+        leaf = bt_search_leaf(cursor->bt, key, &path);
+        index = bt_node_get_key_count(leaf);
+    }
+    else
+    {
+        leaf = bt_search_leaf(cursor->bt, key + 1, &path);
+        index = bt_node_blk_leaf_search(leaf->blk, key + 1);
+    }
+    bt_node_pin(leaf);
+    // keys of UINT64_MAX may go on in next leaves
+    while (key == UINT64_MAX && (next = bt_node_get_right_sibling(leaf)) != NULL)
+    {
+        bt_node_pin(next);
+        bt_node_unpin(leaf);
+        leaf = next;
+        index = bt_node_get_key_count(leaf);
+    }
+    cursor->leaf = leaf;
+    cursor->depth = path.depth;
+
+    if (index > 0)
+    {
+        cursor->index = index - 1;
+        return 1;
+    }
+    return bt_cursor_skip_leaves_left(cursor);
+}
+
+int bt_cursor_seek_rank(BTreeCursor *cursor, uint64_t rank)
+{
+    if (cursor->leaf)
+        bt_node_unpin(cursor->leaf);
+    cursor->leaf = bt_search_rank(cursor->bt, rank, &cursor->index, &cursor->depth);
+    return cursor->leaf != NULL;
+}
+
+int bt_cursor_prev(BTreeCursor *cursor)
+{
+    if (cursor->leaf == NULL)
+        return 0;
+    if (cursor->index > 0)
+    {
+        cursor->index--;
+        return 1;
+    }
+    return bt_cursor_skip_leaves_left(cursor);
+}
+
+uint64_t bt_cursor_key(BTreeCursor *cursor)
+{
+    assert(cursor->leaf);
+    return bt_node_get_key(cursor->leaf, cursor->index);
+}
+
+uint64_t bt_cursor_value(BTreeCursor *cursor)
+{
+    assert(cursor->leaf);
+    return bt_node_get_value(cursor->leaf, cursor->index);
+}
+
+void bt_cursor_close(BTreeCursor *cursor)
+{
+    if (cursor->leaf)
+        bt_node_unpin(cursor->leaf);
+    free(cursor);
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeIO
+/////////////////////////////////////////////////
+
+// one request reads or writes adjacent blocks at offset, a iovec per block
+typedef struct {
+    struct iovec *iov;
+    int           iovcnt;
+    uint64_t      offset;
+    uint64_t      len;          // bytes of all iovecs
+} BTreeIORequest;
+
+// node I/O backend. a batch of requests is submitted together, all of
+// them are completed when readv/writev return.
+struct _BTreeIO {
+    const char *name;
+    int         backend;        // BT_IO_*
+    void (*readv)(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n);
+    void (*writev)(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n);
+    void (*destory)(BTreeIO *io);
+};
+
+static void bt_io_sync_read_request(int fd, BTreeIORequest *req)
+{
+    ssize_t rtv;
+
+    rtv = preadv(fd, req->iov, req->iovcnt, req->offset);
+    assert(rtv == req->len);
+}
+
+static void bt_io_sync_write_request(int fd, BTreeIORequest *req)
+{
+    ssize_t rtv;
+
+    rtv = pwritev(fd, req->iov, req->iovcnt, req->offset);
+    assert(rtv == req->len);
+}
+
+// blocking preadv/pwritev, one request after another
+static void bt_io_sync_readv(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n)
+{
+    uint64_t i;
+
+    (void)io;
+    for (i = 0; i < n; i++)
+        bt_io_sync_read_request(fd, &reqs[i]);
+}
+
+static void bt_io_sync_writev(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n)
+{
+    uint64_t i;
+
+    (void)io;
+    for (i = 0; i < n; i++)
+        bt_io_sync_write_request(fd, &reqs[i]);
+}
+
+// the sync backend is static and has no state
+static void bt_io_sync_destory(BTreeIO *io)
+{
+    (void)io;
+}
+
+static BTreeIO bt_io_sync = {
+    "sync", BT_IO_SYNC, bt_io_sync_readv, bt_io_sync_writev, bt_io_sync_destory
+};
+
+#ifdef BT_HAVE_IO_URING
+
+// submission and completion queue depth
+#define BT_IO_URING_ENTRIES 64
+
+// io_uring by raw syscalls, no liburing needed
+typedef struct {
+    BTreeIO              io;
+    int                  ring_fd;
+    unsigned             entries;
+    int                  broken;    // enter failed, blocking calls from then on
+
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t               sq_ring_size;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+} BTreeIOURing;
+
+// submit requests by rounds of at most entries, wait all of a round
+// completed before next. a failed or short request is redone by
+// blocking call.
+static void bt_io_uring_submit(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n, int opcode)
+{
+    BTreeIOURing        *ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    BTreeIORequest      *req;
+    unsigned             tail, head, index;
+    uint64_t             start, count, i, submitted, completed;
+    long                 rtv;
+
+    ring = (BTreeIOURing *)io;
+    for (start = 0; start < n; start += count)
+    {
+        count = n - start;
+        if (count > ring->entries)
+            count = ring->entries;
+
+        tail = *ring->sq_tail;
+        for (i = 0; i < count; i++)
+        {
+            req = &reqs[start + i];
+            index = (tail + i) & *ring->sq_mask;
+            sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)req->iov;
+            sqe->len = req->iovcnt;
+            sqe->off = req->offset;
+            sqe->user_data = start + i;
+            ring->sq_array[index] = index;
+        }
+        __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+        submitted = 0;
+        completed = 0;
+        while (completed < count)
+        {
+            rtv = syscall(__NR_io_uring_enter, ring->ring_fd, count - submitted,
+                          count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (rtv < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EBUSY)
+                {
+                    // requests not known completed are redone, writing or
+                    // reading the same blocks again does no harm
+                    ring->broken = 1;
+                    if (opcode == IORING_OP_READV)
+                        bt_io_sync_readv(io, fd, reqs + start, n - start);
+                    else
+                        bt_io_sync_writev(io, fd, reqs + start, n - start);
+                    return;
+                }
+                // kernel is short of resources or of room for completions,
+                // reap those there are and try again
+                rtv = 0;
+            }
+            submitted += rtv;
+
+            head = *ring->cq_head;
+            while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            {
+                cqe = &ring->cqes[head & *ring->cq_mask];
+                req = &reqs[cqe->user_data];
+                if (cqe->res < 0 || (uint64_t)cqe->res != req->len)
+                {
+                    if (opcode == IORING_OP_READV)
+                        bt_io_sync_read_request(fd, req);
+                    else
+                        bt_io_sync_write_request(fd, req);
+                }
+                head++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// a single request has nothing to overlap with, skip the ring
+static void bt_io_uring_readv(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n)
+{
+    if (n == 1 || ((BTreeIOURing *)io)->broken)
+        bt_io_sync_readv(io, fd, reqs, n);
+    else
+        bt_io_uring_submit(io, fd, reqs, n, IORING_OP_READV);
+}
+
+static void bt_io_uring_writev(BTreeIO *io, int fd, BTreeIORequest *reqs, uint64_t n)
+{
+    if (n == 1 || ((BTreeIOURing *)io)->broken)
+        bt_io_sync_writev(io, fd, reqs, n);
+    else
+        bt_io_uring_submit(io, fd, reqs, n, IORING_OP_WRITEV);
+}
+
+static void bt_io_uring_destory(BTreeIO *io)
+{
+    BTreeIOURing *ring;
+
+    ring = (BTreeIOURing *)io;
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    free(ring);
+}
+
+// NULL if kernel doesn't support io_uring or it is not permitted
+static BTreeIO *bt_io_uring_new()
+{
+    BTreeIOURing           *ring;
+    struct io_uring_params  params;
+    int                     fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, BT_IO_URING_ENTRIES, &params);
+    if (fd < 0)
+        return NULL;
+
+    ring = (BTreeIOURing *)malloc(sizeof(BTreeIOURing));
+    ring->io.name = "io_uring";
+    ring->io.backend = BT_IO_URING;
+    ring->io.readv = bt_io_uring_readv;
+    ring->io.writev = bt_io_uring_writev;
+    ring->io.destory = bt_io_uring_destory;
+    ring->ring_fd = fd;
+    ring->entries = params.sq_entries;
+    ring->broken = 0;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        bt_io_uring_destory(&ring->io);
+        return NULL;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    return &ring->io;
+}
+
+#endif // BT_HAVE_IO_URING
+
+// io_uring is used if asked for or by default when available,
+// otherwise blocking calls.
+static BTreeIO *bt_io_new(int backend)
+{
+    BTreeIO *io;
+
+    io = NULL;
+#ifdef BT_HAVE_IO_URING
+    if (backend == BT_IO_AUTO || backend == BT_IO_URING)
+        io = bt_io_uring_new();
+#endif
+    if (io == NULL)
+        io = &bt_io_sync;
+    return io;
+}
+
+static void bt_io_destory(BTreeIO *io)
+{
+    io->destory(io);
+}
+
+// trees of a pool share one ring, it is destoryed with the pool. a ring
+// costs a file descriptor and locked memory, a Table would need one for
+// each indexed column otherwise.
+static BTreeIO *bt_pool_get_io(BTreePool *pool, int backend)
+{
+    if (backend == BT_IO_SYNC)
+        return &bt_io_sync;
+    if (pool->io == NULL)
+        pool->io = bt_io_new(backend);
+    return pool->io;
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeLog(redo log of inserts and deletes)
+/////////////////////////////////////////////////
+
+/*
+
+    <file>.wal
+    +--------+--------+--------+-----
+    | header | record | record | ...
+    +--------+--------+--------+-----
+
+    records are inserts and deletes made after the checkpoint of header's
+    generation, the kind of a record is told by its check. they are
+    appended in groups and each group is synced once.
+    a checkpoint (bt_flush) writes blocks, syncs the tree file, then
+    truncates the log and starts a new one with the new generation.
+    if the generation of log is not the tree's, records are already in tree.
+
+*/
+
+#define BT_LOG_MAGIC 0x4C41574545525442      // "BTREEWAL"
+
+typedef struct {
+    uint64_t magic;
+    uint64_t generation;
+} BTreeLogHeader;
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    uint64_t check;     // a torn record at the end doesn't match
+} BTreeLogRecord;
+
+struct _BTreeLog {
+    int             fd;
+    uint64_t        generation;
+    uint64_t        offset;     // end of synced records
+    uint64_t        group;      // records per commit
+    uint64_t        counts;     // records buffered, not written yet
+    BTreeLogRecord *buf;
+};
+
+// kinds of records
+#define BT_LOG_INSERT       0
+#define BT_LOG_DELETE       1   // a pair of key and value
+#define BT_LOG_DELETE_KEY   2   // all values of key
+#define BT_LOG_OPS          3
+
+static uint64_t bt_log_record_check(uint64_t generation, int op, uint64_t key, uint64_t value)
+{
+    return (key * 0x9E3779B97F4A7C15ULL) ^ (value + 0xBF58476D1CE4E5B9ULL) ^ generation ^ BT_LOG_MAGIC ^
+           (op * 0x94D049BB133111EBULL);
+}
+
+// kind of record, -1 if it is torn
+static int bt_log_record_op(uint64_t generation, BTreeLogRecord *record)
+{
+    int op;
+
+    for (op = 0; op < BT_LOG_OPS; op++)
+    {
+        if (record->check == bt_log_record_check(generation, op, record->key, record->value))
+            return op;
+    }
+    return -1;
+}
+
+static BTreeLog *bt_log_open(const char *file, uint64_t group)
+{
+    BTreeLog *log;
+    char     *path;
+
+    path = (char *)malloc(strlen(file) + 5);
+    strcpy(path, file);
+    strcat(path, ".wal");
+
+    log = (BTreeLog *)malloc(sizeof(BTreeLog));
+    log->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    assert(log->fd != -1);
+    log->generation = 0;
+    log->offset = 0;
+    log->group = group ? group : 1;
+    log->counts = 0;
+    log->buf = (BTreeLogRecord *)malloc(sizeof(BTreeLogRecord) * log->group);
+
+    free(path);
+    return log;
+}
+
+static void bt_log_close(BTreeLog *log)
+{
+    assert(log->counts == 0);
+    close(log->fd);
+    free(log->buf);
+    free(log);
+}
+
+// a group commit, buffered records are appended and synced by one call
+static void bt_log_commit(BTreeLog *log)
+{
+    ssize_t  rtv;
+    uint64_t size;
+
+    if (log->counts == 0)
+        return;
+
+    size = log->counts * sizeof(BTreeLogRecord);
+    rtv = pwrite(log->fd, log->buf, size, log->offset);
+    assert(rtv == size);
+    rtv = fdatasync(log->fd);
+    assert(rtv == 0);
+
+    log->offset += size;
+    log->counts = 0;
+}
+
+static void bt_log_append(BTreeLog *log, int op, uint64_t key, uint64_t value)
+{
+    BTreeLogRecord *record;
+
+    record = &log->buf[log->counts++];
+    record->key = key;
+    record->value = value;
+    record->check = bt_log_record_check(log->generation, op, key, value);
+
+    if (log->counts == log->group)
+        bt_log_commit(log);
+}
+
+// drop all records, following ones apply to checkpoint generation
+static void bt_log_reset(BTreeLog *log, uint64_t generation)
+{
+    BTreeLogHeader header;
+    ssize_t        rtv;
+
+    assert(log->counts == 0);
+    rtv = ftruncate(log->fd, 0);
+    assert(rtv == 0);
+
+    header.magic = BT_LOG_MAGIC;
+    header.generation = generation;
+    rtv = pwrite(log->fd, &header, sizeof(header), 0);
+    assert(rtv == sizeof(header));
+    rtv = fdatasync(log->fd);
+    assert(rtv == 0);
+
+    log->generation = generation;
+    log->offset = sizeof(header);
+}
+
+// read records made after checkpoint generation, until the first torn
+// one. return number of records, *records should be freed by caller.
+static uint64_t bt_log_read(BTreeLog *log, uint64_t generation, BTreeLogRecord **records)
+{
+    BTreeLogHeader  header;
+    struct stat     st;
+    ssize_t         rtv;
+    uint64_t        i, n;
+
+    *records = NULL;
+    rtv = pread(log->fd, &header, sizeof(header), 0);
+    if (rtv != sizeof(header) || header.magic != BT_LOG_MAGIC || header.generation != generation)
+        return 0;
+
+    rtv = fstat(log->fd, &st);
+    assert(rtv == 0);
+    n = (st.st_size - sizeof(header)) / sizeof(BTreeLogRecord);
+    *records = (BTreeLogRecord *)malloc(sizeof(BTreeLogRecord) * (n + 1));
+    rtv = pread(log->fd, *records, n * sizeof(BTreeLogRecord), sizeof(header));
+    assert(rtv == n * sizeof(BTreeLogRecord));
+
+    for (i = 0; i < n; i++)
+    {
+        if (bt_log_record_op(generation, &(*records)[i]) < 0)
+            break;
+    }
+    return i;
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTreeShadow(logical to physical block map)
+/////////////////////////////////////////////////
+
+/*
+
+    in shadow mode (version 3 files) blkids are logical, a block map gives
+    the physical block holding each one. a block the checkpoint on disk
+    refers to is never overwritten: a modified node is written to a free
+    physical block and its map entry is changed. map blocks are written
+    the same way and listed by a directory of contiguous blocks, which is
+    named by meta. writing meta at last switches to the new checkpoint.
+
+        meta -> directory blocks -> map blocks -> node blocks
+
+    blocks replaced by a checkpoint become free once its meta is on disk.
+    free blocks are not recorded, they are found again when file is opened.
+
+*/
+
+struct _BTreeShadow {
+    uint64_t  entries;          // map entries in a block
+    uint64_t *map;              // physical blkid by logical, 0 if not written
+    uint64_t  map_size;         // multiple of entries
+    uint8_t  *map_dirty;        // by map block, changed since checkpoint
+    uint64_t  map_dirty_size;
+    int       changed;          // any entry changed since checkpoint
+    uint64_t *dir;              // physical blkid by map block
+    uint64_t  dir_size;         // multiple of entries
+    uint64_t  dir_blkid;        // directory of the checkpoint
+    uint64_t  dir_blocks;
+    uint64_t  phys_blocks;      // blocks in file
+
+    uint8_t  *fresh;            // by physical blkid, allocated since checkpoint
+    uint64_t  fresh_size;
+    uint64_t *free;             // reusable now, smaller blkids at the end
+    uint64_t  free_counts;
+    uint64_t  free_size;
+    uint64_t *pending;          // reusable after checkpoint
+    uint64_t  pending_counts;
+    uint64_t  pending_size;
+};
+
+// grow *array of *size elements to hold need, rounded up to multiple.
+// new elements are zero.
+static void bt_array_reserve(void **array, uint64_t *size, uint64_t need, uint64_t elem_size, uint64_t multiple)
+{
+    uint64_t new_size;
+
+    if (need <= *size)
+        return;
+    new_size = *size ? *size : multiple;
+    while (new_size < need)
+        new_size *= 2;
+    new_size = (new_size + multiple - 1) / multiple * multiple;
+
+    *array = realloc(*array, new_size * elem_size);
+    memset((char *)*array + *size * elem_size, 0, (new_size - *size) * elem_size);
+    *size = new_size;
+}
+
+static void bt_array_push(uint64_t **array, uint64_t *counts, uint64_t *size, uint64_t value)
+{
+    bt_array_reserve((void **)array, size, *counts + 1, sizeof(uint64_t), 1);
+    (*array)[(*counts)++] = value;
+}
+
+static BTreeShadow *bt_shadow_new(uint64_t blksize, uint64_t phys_blocks)
+{
+    BTreeShadow *shadow;
+
+    shadow = (BTreeShadow *)malloc(sizeof(BTreeShadow));
+    memset(shadow, 0, sizeof(BTreeShadow));
+    shadow->entries = blksize / sizeof(uint64_t);
+    shadow->phys_blocks = phys_blocks;
+    return shadow;
+}
+
+static void bt_shadow_destory(BTreeShadow *shadow)
+{
+    free(shadow->map);
+    free(shadow->map_dirty);
+    free(shadow->dir);
+    free(shadow->fresh);
+    free(shadow->free);
+    free(shadow->pending);
+    free(shadow);
+}
+
+static uint64_t bt_shadow_get(BTreeShadow *shadow, uint64_t blkid)
+{
+    assert(blkid < shadow->map_size && shadow->map[blkid]);
+    return shadow->map[blkid];
+}
+
+static int bt_compare_blkid_reverse(const void *a, const void *b)
+{
+    return bt_compare_blkid(b, a);
+}
+
+// n free blocks in ascending order, adjacent ones if possible
+static void bt_shadow_alloc(BTreeShadow *shadow, uint64_t *blkids, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (shadow->free_counts)
+            blkids[i] = shadow->free[--shadow->free_counts];
+        else
+            blkids[i] = shadow->phys_blocks++;
+    }
+    qsort(blkids, n, sizeof(uint64_t), bt_compare_blkid);
+
+    bt_array_reserve((void **)&shadow->fresh, &shadow->fresh_size, shadow->phys_blocks, 1, 4096);
+    for (i = 0; i < n; i++)
+        shadow->fresh[blkids[i]] = 1;
+}
+
+// n adjacent free blocks, return the first one. the lowest run in free
+// blocks is taken, blocks at end of file if there is none.
+static uint64_t bt_shadow_alloc_run(BTreeShadow *shadow, uint64_t n)
+{
+    uint64_t i, k, len, start;
+
+    // free is sorted descending, a run ascends from the end
+    if (shadow->free_counts)
+        qsort(shadow->free, shadow->free_counts, sizeof(uint64_t), bt_compare_blkid_reverse);
+    len = 0;
+    k = 0;
+    for (i = shadow->free_counts; i > 0; i--)
+    {
+        k = i - 1;
+        if (len > 0 && shadow->free[k] == shadow->free[k + 1] + 1)
+            len++;
+        else
+            len = 1;
+        if (len == n)
+            break;
+    }
+
+    if (n > 0 && len == n)
+    {
+        // the run is free[k, k + n), its first block is at the end
+        start = shadow->free[k + n - 1];
+        memmove(shadow->free + k, shadow->free + k + n, (shadow->free_counts - k - n) * sizeof(uint64_t));
+        shadow->free_counts -= n;
+    }
+    else
+    {
+        start = shadow->phys_blocks;
+        shadow->phys_blocks += n;
+    }
+
+    bt_array_reserve((void **)&shadow->fresh, &shadow->fresh_size, shadow->phys_blocks, 1, 4096);
+    for (i = 0; i < n; i++)
+        shadow->fresh[start + i] = 1;
+    return start;
+}
+
+// a block no longer used. if the checkpoint on disk refers to it, it is
+// kept until next checkpoint.
+static void bt_shadow_release(BTreeShadow *shadow, uint64_t blkid)
+{
+    if (blkid == 0)
+        return;
+    if (blkid < shadow->fresh_size && shadow->fresh[blkid])
+    {
+        shadow->fresh[blkid] = 0;
+        bt_array_push(&shadow->free, &shadow->free_counts, &shadow->free_size, blkid);
+    }
+    else
+        bt_array_push(&shadow->pending, &shadow->pending_counts, &shadow->pending_size, blkid);
+}
+
+// logical blkid is written to physical block phys
+// make map cover blkids [0, n)
+static void bt_shadow_reserve(BTreeShadow *shadow, uint64_t n)
+{
+    bt_array_reserve((void **)&shadow->map, &shadow->map_size, n, sizeof(uint64_t), shadow->entries);
+    bt_array_reserve((void **)&shadow->map_dirty, &shadow->map_dirty_size,
+                     shadow->map_size / shadow->entries, 1, 1);
+}
+
+static void bt_shadow_set(BTreeShadow *shadow, uint64_t blkid, uint64_t phys)
+{
+    bt_shadow_reserve(shadow, blkid + 1);
+
+    bt_shadow_release(shadow, shadow->map[blkid]);
+    shadow->map[blkid] = phys;
+    shadow->map_dirty[blkid / shadow->entries] = 1;
+    shadow->changed = 1;
+}
+
+// meta of a new checkpoint is on disk
+static void bt_shadow_commit(BTreeShadow *shadow)
+{
+    uint64_t i;
+
+    for (i = 0; i < shadow->pending_counts; i++)
+        bt_array_push(&shadow->free, &shadow->free_counts, &shadow->free_size, shadow->pending[i]);
+    shadow->pending_counts = 0;
+    if (shadow->free_counts)
+        qsort(shadow->free, shadow->free_counts, sizeof(uint64_t), bt_compare_blkid_reverse);
+
+    if (shadow->fresh_size)
+        memset(shadow->fresh, 0, shadow->fresh_size);
+    if (shadow->map_dirty_size)
+        memset(shadow->map_dirty, 0, shadow->map_dirty_size);
+    shadow->changed = 0;
+}
+
+// every block not referred by map, directory or meta is free
+static void bt_shadow_find_free(BTreeShadow *shadow, uint64_t max_blkid)
+{
+    uint8_t  *used;
+    uint64_t  i;
+
+    used = (uint8_t *)malloc(shadow->phys_blocks);
+    memset(used, 0, shadow->phys_blocks);
+    used[0] = 1;
+    for (i = 1; i <= max_blkid && i < shadow->map_size; i++)
+        used[shadow->map[i]] = 1;
+    for (i = 0; i < (max_blkid + shadow->entries) / shadow->entries; i++)
+        used[shadow->dir[i]] = 1;
+    for (i = 0; i < shadow->dir_blocks; i++)
+        used[shadow->dir_blkid + i] = 1;
+
+    shadow->free_counts = 0;
+    for (i = shadow->phys_blocks; i > 0; i--)
+    {
+        if (!used[i - 1])
+            bt_array_push(&shadow->free, &shadow->free_counts, &shadow->free_size, i - 1);
+    }
+    free(used);
+}
+
+
+
+
+/////////////////////////////////////////////////
+//  BTree
+/////////////////////////////////////////////////
+
+static uint64_t bt_get_max_keys(BTree *bt)
+{
+    return bt->max_keys;
+}
+
+static uint64_t bt_get_min_keys(BTree *bt)
+{
+    return bt->min_keys;
+}
+
+static uint64_t bt_get_order(BTree *bt)
+{
+    return bt_meta_get_order(bt->meta);
+}
+
+static uint64_t bt_get_blksize(BTree *bt)
+{
+    return bt_meta_get_blksize(bt->meta);
+}
+
+static uint64_t bt_get_max_blkid(BTree *bt)
+{
+    return bt_meta_get_maxblkid(bt->meta);
+}
+
+static uint64_t bt_next_blkid(BTree *bt)
+{
+    return bt_meta_next_blkid(bt->meta);
+}
+
+static uint64_t bt_get_root_blkid(BTree *bt)
+{
+    return bt_meta_get_root_blkid(bt->meta);
+}
+
+static void bt_set_node(BTree *bt, uint64_t blkid, BTreeNode *node)
+{
+    assert(blkid <= bt_get_max_blkid(bt));
+    assert(node->blkid == blkid);
+
+    bt_node_table_put(&bt->nodes, node);
+}
+
+static void bt_unset_node(BTree *bt, uint64_t blkid)
+{
+    bt_node_table_remove(&bt->nodes, blkid);
+}
+
+static BTreeNode *bt_get_node(BTree *bt, uint64_t blkid)
+{
+    BTreeNode *node;
+    uint64_t   max_blkid;
+    max_blkid = bt_get_max_blkid(bt);
+
+    assert(blkid <= max_blkid);
+
+    node = bt_node_table_get(&bt->nodes, blkid);
+    if (node == NULL)
+    {
+        bt->pool->misses++;
+        return bt_node_new_from_file(bt, blkid);
+    }
+
+    bt_pool_hit(bt->pool, node);
+    return node;
+}
+
+static void bt_open_file(BTree *bt)
+{
+    if(bt->file_fd == -1)
+    {
+        bt->file_fd = open(bt->file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    }
+    assert(bt->file_fd != -1);
+}
+
+static void bt_load_blk(BTree *bt, void *dst, uint64_t blkid)
+{
+    BTreeIORequest  req;
+    struct iovec    iov;
+    uint64_t        blksize;
+
+    // when load Meta block, blksize is unknown
+    if (blkid == 0)
+        blksize = sizeof(BTreeMetaBlk);
+    else
+        blksize = bt_get_blksize(bt);
+    
+    bt_open_file(bt);
+    iov.iov_base = dst;
+    iov.iov_len = blksize;
+    req.iov = &iov;
+    req.iovcnt = 1;
+    req.offset = bt_phys_blkid(bt, blkid) * blksize;
+    req.len = blksize;
+    bt->io->readv(bt->io, bt->file_fd, &req, 1);
+}
+
+static void bt_store_blk(BTree *bt, uint64_t blkid)
+{
+    BTreeIORequest  req;
+    struct iovec    iov;
+    uint64_t        blksize;
+    void           *blk;
+
+    if(blkid == 0)
+        blk = (void *)bt->meta->blk;
+    else
+        blk = (void *)bt_node_table_get(&bt->nodes, blkid)->blk;
+    
+
+    blksize = bt_get_blksize(bt);
+    bt_open_file(bt);
+    iov.iov_base = blk;
+    iov.iov_len = blksize;
+    req.iov = &iov;
+    req.iovcnt = 1;
+    req.offset = bt_phys_blkid(bt, blkid) * blksize;
+    req.len = blksize;
+    bt->io->writev(bt->io, bt->file_fd, &req, 1);
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// group iov[n] of blocks blkids[n] (sorted) into requests of adjacent
+// blocks, no longer than IOV_MAX. return number of requests.
+static uint64_t bt_io_requests(BTree *bt, BTreeIORequest *reqs, struct iovec *iov, uint64_t *blkids, uint64_t n)
+{
+    uint64_t  blksize;
+    uint64_t  start, count, nreqs;
+
+    blksize = bt_get_blksize(bt);
+    nreqs = 0;
+    for (start = 0; start < n; start += count)
+    {
+        count = 1;
+        while (start + count < n && count < IOV_MAX &&
+               blkids[start + count] == blkids[start] + count)
+            count++;
+
+        reqs[nreqs].iov = &iov[start];
+        reqs[nreqs].iovcnt = count;
+        reqs[nreqs].offset = blkids[start] * blksize;
+        reqs[nreqs].len = count * blksize;
+        nreqs++;
+    }
+    return nreqs;
+}
+
+static int bt_compare_blkid(const void *a, const void *b)
+{
+    uint64_t blkid_a = *(const uint64_t *)a;
+    uint64_t blkid_b = *(const uint64_t *)b;
+
+    return blkid_a < blkid_b ? -1 : blkid_a > blkid_b;
+}
+
+// read or write blks[n] at physical blocks physids[n] (sorted) in one
+// batch. return number of requests.
+static uint64_t bt_io_blks(BTree *bt, void **blks, uint64_t *physids, uint64_t n, int write)
+{
+    BTreeIORequest *reqs;
+    struct iovec   *iov;
+    uint64_t        i, nreqs;
+
+    reqs = (BTreeIORequest *)malloc(sizeof(BTreeIORequest) * (n + 1));
+    iov = (struct iovec *)malloc(sizeof(struct iovec) * (n + 1));
+    for (i = 0; i < n; i++)
+    {
+        iov[i].iov_base = blks[i];
+        iov[i].iov_len = bt_get_blksize(bt);
+    }
+    nreqs = bt_io_requests(bt, reqs, iov, physids, n);
+
+    bt_open_file(bt);
+    if (write)
+        bt->io->writev(bt->io, bt->file_fd, reqs, nreqs);
+    else
+        bt->io->readv(bt->io, bt->file_fd, reqs, nreqs);
+    free(iov);
+    free(reqs);
+    return nreqs;
+}
+
+// read blocks blkids[n] (sorted) into dsts[n] in one batch
+static void bt_load_blks(BTree *bt, void **dsts, uint64_t *blkids, uint64_t n)
+{
+    uint64_t *physids;
+    void    **blks;
+    uint64_t  i, j, phys;
+    void     *blk;
+
+    physids = (uint64_t *)malloc(sizeof(uint64_t) * n);
+    blks = (void **)malloc(sizeof(void *) * n);
+    // mapped blocks are not in logical order, insertion sort, n is small
+    for (i = 0; i < n; i++)
+    {
+        phys = bt_phys_blkid(bt, blkids[i]);
+        blk = dsts[i];
+        for (j = i; j > 0 && physids[j - 1] > phys; j--)
+        {
+            physids[j] = physids[j - 1];
+            blks[j] = blks[j - 1];
+        }
+        physids[j] = phys;
+        blks[j] = blk;
+    }
+
+    bt_io_blks(bt, blks, physids, n, 0);
+    free(blks);
+    free(physids);
+}
+
+static int bt_node_compare_blkid(const void *a, const void *b)
+{
+    return bt_compare_blkid(&(*(BTreeNode * const *)a)->blkid,
+                            &(*(BTreeNode * const *)b)->blkid);
+}
+
+// write blocks of nodes in blkid order, blocks with adjacent blkids are
+// written by one request, all requests are submitted as one batch.
+// return number of requests.
+// in shadow mode nodes are written to newly allocated blocks, in the
+// same order as blkids.
+static uint64_t bt_store_nodes(BTree *bt, BTreeNode **nodes, uint64_t n)
+{
+    void          **blks;
+    uint64_t       *physids;
+    uint64_t        i, nreqs;
+
+    qsort(nodes, n, sizeof(BTreeNode *), bt_node_compare_blkid);
+
+    blks = (void **)malloc(sizeof(void *) * (n + 1));
+    physids = (uint64_t *)malloc(sizeof(uint64_t) * (n + 1));
+    if (bt->shadow)
+        bt_shadow_alloc(bt->shadow, physids, n);
+    for (i = 0; i < n; i++)
+    {
+        blks[i] = nodes[i]->blk;
+        if (bt->shadow)
+            bt_shadow_set(bt->shadow, nodes[i]->blkid, physids[i]);
+        else
+            physids[i] = nodes[i]->blkid;
+    }
+    nreqs = bt_io_blks(bt, blks, physids, n, 1);
+
+    free(physids);
+    free(blks);
+    return nreqs;
+}
+
+// write map blocks changed since checkpoint, then the whole directory.
+// return number of requests, *blocks is increased by blocks written.
+static uint64_t bt_store_shadow_map(BTree *bt, uint64_t *blocks)
+{
+    BTreeShadow *shadow;
+    void       **blks;
+    uint64_t    *physids;
+    uint64_t     i, n, map_blocks, nreqs;
+
+    shadow = bt->shadow;
+    map_blocks = (bt_get_max_blkid(bt) + shadow->entries) / shadow->entries;
+    bt_shadow_reserve(shadow, map_blocks * shadow->entries);
+    bt_array_reserve((void **)&shadow->dir, &shadow->dir_size, map_blocks, sizeof(uint64_t), shadow->entries);
+
+    blks = (void **)malloc(sizeof(void *) * map_blocks);
+    physids = (uint64_t *)malloc(sizeof(uint64_t) * map_blocks);
+    n = 0;
+    for (i = 0; i < map_blocks; i++)
+    {
+        if (shadow->dir[i] == 0 || shadow->map_dirty[i])
+            blks[n++] = &shadow->map[i * shadow->entries];
+    }
+    bt_shadow_alloc(shadow, physids, n);
+    n = 0;
+    for (i = 0; i < map_blocks; i++)
+    {
+        if (shadow->dir[i] == 0 || shadow->map_dirty[i])
+        {
+            bt_shadow_release(shadow, shadow->dir[i]);
+            shadow->dir[i] = physids[n++];
+        }
+    }
+    nreqs = bt_io_blks(bt, blks, physids, n, 1);
+    *blocks += n;
+    free(physids);
+    free(blks);
+
+    // directory is rewritten as a whole to free adjacent blocks, its old
+    // blocks are free after checkpoint, for the directory of the next one.
+    for (i = 0; i < shadow->dir_blocks; i++)
+        bt_shadow_release(shadow, shadow->dir_blkid + i);
+    shadow->dir_blocks = (map_blocks + shadow->entries - 1) / shadow->entries;
+    shadow->dir_blkid = bt_shadow_alloc_run(shadow, shadow->dir_blocks);
+    blks = (void **)malloc(sizeof(void *) * shadow->dir_blocks);
+    physids = (uint64_t *)malloc(sizeof(uint64_t) * shadow->dir_blocks);
+    for (i = 0; i < shadow->dir_blocks; i++)
+    {
+        blks[i] = &shadow->dir[i * shadow->entries];
+        physids[i] = shadow->dir_blkid + i;
+    }
+    nreqs += bt_io_blks(bt, blks, physids, shadow->dir_blocks, 1);
+    *blocks += shadow->dir_blocks;
+    free(physids);
+    free(blks);
+
+    bt->meta->blk->map_dir_blkid = shadow->dir_blkid;
+    bt->meta->blk->map_dir_blocks = shadow->dir_blocks;
+    bt->meta->blk->phys_blocks = shadow->phys_blocks;
+    return nreqs;
+}
+
+// read block map of a version 3 file
+static void bt_load_shadow_map(BTree *bt)
+{
+    BTreeShadow  *shadow;
+    BTreeMetaBlk *meta;
+    void        **blks;
+    uint64_t     *physids;
+    uint64_t      i, map_blocks;
+
+    meta = bt->meta->blk;
+    shadow = bt_shadow_new(bt_get_blksize(bt), meta->phys_blocks);
+    shadow->dir_blkid = meta->map_dir_blkid;
+    shadow->dir_blocks = meta->map_dir_blocks;
+
+    map_blocks = (meta->max_blkid + shadow->entries) / shadow->entries;
+    assert(map_blocks <= shadow->dir_blocks * shadow->entries);
+    bt_array_reserve((void **)&shadow->dir, &shadow->dir_size, shadow->dir_blocks * shadow->entries,
+                     sizeof(uint64_t), shadow->entries);
+    bt_shadow_reserve(shadow, map_blocks * shadow->entries);
+
+    blks = (void **)malloc(sizeof(void *) * (shadow->dir_blocks + map_blocks));
+    physids = (uint64_t *)malloc(sizeof(uint64_t) * (shadow->dir_blocks + map_blocks));
+    for (i = 0; i < shadow->dir_blocks; i++)
+    {
+        blks[i] = &shadow->dir[i * shadow->entries];
+        physids[i] = shadow->dir_blkid + i;
+    }
+    bt_io_blks(bt, blks, physids, shadow->dir_blocks, 0);
+
+    // map blocks are sorted by logical blkid, read them one by one
+    for (i = 0; i < map_blocks; i++)
+    {
+        blks[0] = &shadow->map[i * shadow->entries];
+        bt_io_blks(bt, blks, &shadow->dir[i], 1, 0);
+    }
+    free(physids);
+    free(blks);
+
+    bt_shadow_find_free(shadow, meta->max_blkid);
+    bt->shadow = shadow;
+}
+
+// start shadow paging. blocks of an existing file are mapped to themselves.
+static void bt_use_shadow(BTree *bt, int existing)
+{
+    BTreeShadow *shadow;
+    uint64_t     i, max_blkid;
+
+    max_blkid = bt_get_max_blkid(bt);
+    shadow = bt_shadow_new(bt_get_blksize(bt), existing ? max_blkid + 1 : 1);
+    bt->shadow = shadow;
+    if (existing)
+    {
+        for (i = 1; i <= max_blkid; i++)
+            bt_shadow_set(shadow, i, i);
+        // identity entries are not fresh, nothing was released
+        assert(shadow->free_counts == 0 && shadow->pending_counts == 0);
+    }
+    bt->meta->blk->version = BTREE_FILE_VERSION_SHADOW;
+    bt->meta->dirty = 1;
+}
+
+static uint64_t bt_phys_blkid(BTree *bt, uint64_t blkid)
+{
+    if (blkid == 0 || bt->shadow == NULL)
+        return blkid;
+    return bt_shadow_get(bt->shadow, blkid);
+}
+
+static void bt_load_meta(BTree *bt)
+{
+    BTreeMeta   *meta;
+    
+    meta = bt_meta_new_from_file(bt);
+
+    bt->meta = meta;
+}
+
+static void bt_load_root(BTree *bt)
+{
+    uint64_t      root_blk_id;
+    BTreeNode    *root;
+   
+    root_blk_id = bt_get_root_blkid(bt);
+    root = bt_node_new_from_file(bt, root_blk_id);
+    
+    bt_set_root(bt, root);
+}
+
+// rewrite a version 0 file in current layout, blkids are kept.
+// the new file is written aside and renamed over the old one at last,
+// a crash during upgrade leaves the old file untouched.
+static void bt_upgrade_legacy_file(const char *file)
+{
+    int                 fd, new_fd;
+    ssize_t             rtv;
+    char               *new_file;
+    BTreeMetaBlk        meta;
+    BTreeMetaBlk       *new_meta;
+    BTreeLegacyNodeBlk *legacy;
+    BTreeNodeBlk       *blk;
+    uint64_t           *legacy_pairs;
+    uint64_t            blkid, i, order, blksize, children;
+
+    fd = open(file, O_RDWR);
+    assert(fd != -1);
+    rtv = pread(fd, &meta, sizeof(BTreeMetaBlk), 0);
+    assert(rtv == sizeof(BTreeMetaBlk));
+    assert(meta.magic == BTREE_FILE_MAGIC);   // bad tree file
+    if (meta.version != BTREE_FILE_VERSION_LEGACY)
+    {
+        close(fd);
+        return;
+    }
+
+    order = meta.order;
+    blksize = sizeof(BTreeNodeBlk) + (order * 2 + 1) * sizeof(uint64_t);
+
+    new_file = (char *)malloc(strlen(file) + sizeof(".upgrade"));
+    strcpy(new_file, file);
+    strcat(new_file, ".upgrade");
+    new_fd = open(new_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(new_fd != -1);
+
+    new_meta = bt_meta_blk_new_empty(order, blksize);
+    new_meta->root_blkid = meta.root_blkid;
+    new_meta->blk_counts = meta.blk_counts;
+    new_meta->max_blkid = meta.max_blkid;
+    rtv = pwrite(new_fd, new_meta, blksize, 0);
+    assert(rtv == blksize);
+
+    legacy = (BTreeLegacyNodeBlk *)malloc(meta.blk_size);
+    legacy_pairs = (uint64_t *)(legacy + 1);
+    for (blkid = 1; blkid <= meta.max_blkid; blkid++)
+    {
+        rtv = pread(fd, legacy, meta.blk_size, blkid * meta.blk_size);
+        assert(rtv == meta.blk_size);
+
+        blk = bt_node_blk_new_empty(blksize, order, legacy->type);
+        blk->key_counts = legacy->key_counts;
+        blk->left_sibling_blkid = legacy->left_sibling_blkid;
+        blk->right_sibling_blkid = legacy->right_sibling_blkid;
+
+        children = blk->type & BT_NODE_TYPE_LEAF ? blk->key_counts : blk->key_counts + 1;
+        for (i = 0; i < blk->key_counts; i++)
+            bt_node_blk_keys(blk)[i] = legacy_pairs[i * 2 + 1];
+        for (i = 0; i < children; i++)
+            bt_node_blk_slots(blk)[i] = legacy_pairs[i * 2];
+
+        rtv = pwrite(new_fd, blk, blksize, blkid * blksize);
+        assert(rtv == blksize);
+        bt_node_blk_destory(blk);
+    }
+
+    rtv = fsync(new_fd);
+    assert(rtv == 0);
+    rtv = rename(new_file, file);
+    assert(rtv == 0);
+
+    free(legacy);
+    bt_meta_blk_destory(new_meta);
+    free(new_file);
+    close(new_fd);
+    close(fd);
+}
+
+static void bt_use_pool(BTree *bt, BTreeOpenFlag *flag)
+{
+    if (flag->pool)
+    {
+        bt->pool = flag->pool;
+        bt->own_pool = 0;
+    }
+    else
+    {
+        bt->pool = bt_pool_new(flag->cache_size);
+        bt->own_pool = 1;
+    }
+}
+
+static BTree *bt_new_from_file(BTreeOpenFlag *flag)
+{
+    BTree    *bt;
+    uint64_t  order;
+    
+    bt = (BTree *)malloc(sizeof(BTree));
+    INIT_LIST_HEAD(&bt->deleted_node_chain);
+    INIT_LIST_HEAD(&bt->new_node_chain);
+    INIT_LIST_HEAD(&bt->dirty_node_chain);
+    bt->dirty_counts = 0;
+    bt->file_path = (char *)malloc(strlen(flag->file) + 1);
+    strcpy(bt->file_path, flag->file);
+    bt->file_fd = -1;
+    bt->root = NULL;
+    bt->shadow = NULL;
+    bt->append_path.depth = 0;
+    memset(&bt->flush_stat, 0, sizeof(BTreeFlushStat));
+    bt_use_pool(bt, flag);
+    bt->io = bt_pool_get_io(bt->pool, flag->io);
+    bt_load_meta(bt);
+    bt->flush_stat.generation = bt_meta_get_generation(bt->meta);
+    if (bt->meta->blk->version == BTREE_FILE_VERSION_SHADOW)
+        bt_load_shadow_map(bt);
+    else if (flag->shadow)
+        bt_use_shadow(bt, 1);
+    bt->slab = bt_pool_get_slab(bt->pool, bt_node_frame_size(bt_get_blksize(bt)));
+    order = bt_get_order(bt);
+    bt->max_keys = order - 1;
+    bt->min_keys = order / 2;
+    // node blk id start from 1
+    bt_node_table_init(&bt->nodes, BT_NODE_TABLE_MIN_SIZE);
+
+    bt_load_root(bt);
+
+    return bt;
+}
+
+static BTree *bt_new_empty(BTreeOpenFlag *flag)
+{
+    uint64_t      blksize;
+    uint64_t      order;
+    BTree        *bt;
+    
+    bt = (BTree *)malloc(sizeof(BTree));
+ 
+    INIT_LIST_HEAD(&bt->deleted_node_chain);
+    INIT_LIST_HEAD(&bt->new_node_chain);
+    INIT_LIST_HEAD(&bt->dirty_node_chain);
+    bt->dirty_counts = 0;
+
+    order = flag->order;
+    bt->file_path = (char *)malloc(strlen(flag->file) + 1);
+    strcpy(bt->file_path, flag->file);
+    bt->file_fd = -1;
+    bt->root = NULL;
+    bt->shadow = NULL;
+    bt->append_path.depth = 0;
+    memset(&bt->flush_stat, 0, sizeof(BTreeFlushStat));
+    bt_use_pool(bt, flag);
+    bt->io = bt_pool_get_io(bt->pool, flag->io);
+    bt->max_keys = order - 1;
+    bt->min_keys = order / 2;
+
+    // counts of children follow them in counted trees
+    if (flag->counted)
+        blksize = sizeof(BTreeNodeBlk) + (order * 3 + 2) * sizeof(uint64_t);
+    else
+        blksize = sizeof(BTreeNodeBlk) + (order * 2 + 1) * sizeof(uint64_t);
+    assert(blksize >= sizeof(BTreeMetaBlk));
+
+    bt->meta = bt_meta_new_empty(order, blksize);
+    bt->meta->blk->counted = flag->counted != 0;
+    if (flag->shadow)
+        bt_use_shadow(bt, 0);
+    bt->slab = bt_pool_get_slab(bt->pool, bt_node_frame_size(blksize));
+
+    bt_node_table_init(&bt->nodes, BT_NODE_TABLE_MIN_SIZE);
+
+    bt_set_root(bt, bt_node_new_empty(bt, BT_NODE_TYPE_LEAF | BT_NODE_TYPE_ROOT));
+
+    return bt;
+}
+
+// write node and forget it was modified
+static void bt_node_write_back(BTreeNode *node)
+{
+    BTreeShadow *shadow;
+    uint64_t     phys;
+
+    // never overwrite a block of checkpoint on disk
+    shadow = node->tree->shadow;
+    if (shadow)
+    {
+        bt_shadow_alloc(shadow, &phys, 1);
+        bt_shadow_set(shadow, node->blkid, phys);
+    }
+    bt_store_blk(node->tree, node->blkid);
+    bt_node_marked_clean(node);
+}
+
+// a checkpoint, only blocks modified since last flush are written:
+// new and dirty nodes become clean after written.
+// blocks are written in blkid order, adjacent ones in one call.
+void bt_flush(BTree *bt)
+{
+    BTreeNode  *node;
+    BTreeNode **nodes;
+    uint64_t    blocks, writes, n;
+    int         rtv;
+    struct list_head *chain;
+
+    blocks = 0;
+    writes = 0;
+    // records are not needed after checkpoint, but keep them until it is
+    // complete
+    if (bt->log)
+        bt_log_commit(bt->log);
+    // nodes written aside by eviction or bt_write_back are only in map
+    if (!list_empty(&bt->new_node_chain) || !list_empty(&bt->dirty_node_chain) || bt->meta->dirty ||
+        (bt->shadow && bt->shadow->changed))
+    {
+        bt_meta_next_generation(bt->meta);
+
+        n = 0;
+        list_for_each(chain, &bt->new_node_chain)
+            n++;
+        list_for_each(chain, &bt->dirty_node_chain)
+            n++;
+        nodes = (BTreeNode **)malloc(sizeof(BTreeNode *) * (n + 1));
+
+        n = 0;
+        while (!list_empty(&bt->new_node_chain))
+        {
+            node = list_entry(bt->new_node_chain.next, BTreeNode, chain);
+            bt_node_marked_clean(node);
+            nodes[n++] = node;
+        }
+        while (!list_empty(&bt->dirty_node_chain))
+        {
+            node = list_entry(bt->dirty_node_chain.next, BTreeNode, chain);
+            bt_node_marked_clean(node);
+            nodes[n++] = node;
+        }
+        writes += bt_store_nodes(bt, nodes, n);
+        blocks += n;
+        free(nodes);
+
+        // blocks must be on disk before meta: in shadow mode nothing above
+        // is visible until meta is written, with a log records before the
+        // new generation are dropped once meta has it.
+        if (bt->shadow)
+            writes += bt_store_shadow_map(bt, &blocks);
+        if (bt->shadow || bt->log)
+        {
+            rtv = fdatasync(bt->file_fd);
+            assert(rtv == 0);
+        }
+
+        // meta at last, it refers to nodes written above
+        bt_store_blk(bt, 0);
+        bt->meta->dirty = 0;
+        blocks++;
+        writes++;
+
+        if (bt->shadow || bt->log)
+        {
+            rtv = fdatasync(bt->file_fd);
+            assert(rtv == 0);
+        }
+        if (bt->shadow)
+            bt_shadow_commit(bt->shadow);
+        if (bt->log)
+            bt_log_reset(bt->log, bt_meta_get_generation(bt->meta));
+    }
+
+    bt->flush_stat.generation = bt_meta_get_generation(bt->meta);
+    bt->flush_stat.blocks = blocks;
+    bt->flush_stat.bytes = blocks * bt_get_blksize(bt);
+    bt->flush_stat.writes = writes;
+    bt->flush_stat.total_blocks += blocks;
+    bt->flush_stat.total_bytes += blocks * bt_get_blksize(bt);
+}
+
+// write oldest modified blocks, at most max_blocks of them, without a
+// checkpoint. like eviction, blocks are written in place or aside in
+// shadow mode. a logged tree without shadow paging makes a checkpoint.
+uint64_t bt_write_back(BTree *bt, uint64_t max_blocks)
+{
+    BTreeNode  *node;
+    BTreeNode **nodes;
+    uint64_t    n;
+
+    // written in place, blocks would mix into the last checkpoint, a
+    // crash would leave neither it nor the next one
+    if (bt->dirty_counts == 0 || max_blocks == 0 || !bt->shadow)
+        return 0;
+
+    if (max_blocks > bt->dirty_counts)
+        max_blocks = bt->dirty_counts;
+    nodes = (BTreeNode **)malloc(sizeof(BTreeNode *) * max_blocks);
+    // nodes are added at head of chains, oldest ones are at tail
+    n = 0;
+    while (n < max_blocks && !list_empty(&bt->dirty_node_chain))
+    {
+        node = list_entry(bt->dirty_node_chain.prev, BTreeNode, chain);
+        bt_node_marked_clean(node);
+        nodes[n++] = node;
+    }
+    while (n < max_blocks && !list_empty(&bt->new_node_chain))
+    {
+        node = list_entry(bt->new_node_chain.prev, BTreeNode, chain);
+        bt_node_marked_clean(node);
+        nodes[n++] = node;
+    }
+    bt_store_nodes(bt, nodes, n);
+    free(nodes);
+    return n;
+}
+
+uint64_t bt_get_dirty_bytes(BTree *bt)
+{
+    return bt->dirty_counts * bt_get_blksize(bt);
+}
+
+void bt_get_flush_stat(BTree *bt, BTreeFlushStat *stat)
+{
+    *stat = bt->flush_stat;
+}
+
+// balance pool at the end of an insert or delete of bt. modified nodes of
+// a tree without shadow are not evicted, if pool stays over capacity the
+// tree makes a checkpoint here, where all its changes are applied. so a
+// checkpoint never runs inside an operation, or for another tree of pool.
+static void bt_balance(BTree *bt)
+{
+    BTreePool *pool;
+
+    pool = bt->pool;
+    bt_pool_balance(pool);
+    if (!bt->shadow && bt->dirty_counts > 0 &&
+        pool->capacity != 0 && pool->used > pool->capacity)
+    {
+        bt_flush(bt);
+        bt_pool_balance(pool);
+    }
 }
 
-static void bt_values_put_value(BTreeValues *values, uint64_t value)
+void bt_insert(BTree *bt, uint64_t key, uint64_t value)
 {
-    values->counts ++;
-    // TODO : efficent allocate
-    values->values = realloc(values->values, values->counts * sizeof(uint64_t));
-    values->values[values->counts - 1] = value;
+    BTreePath   path;
+
+    if (bt->log)
+        bt_log_append(bt->log, BT_LOG_INSERT, key, value);
+
+    if (!bt_append_path_match(bt, key, &path))
+        bt_search_leaf(bt, key, &path);
+    bt_path_leaf_insert(bt, &path, key, value);
+    bt_append_path_keep(bt, &path);
+
+    bt_balance(bt);
 }
 
-uint64_t bt_values_get_value(BTreeValues *values, uint64_t index)
+static int bt_compare_pair(const void *a, const void *b)
 {
-    assert(index < values->counts);
-    return values->values[index];
+    const BTreePair *pa = (const BTreePair *)a;
+    const BTreePair *pb = (const BTreePair *)b;
+
+    if (pa->key != pb->key)
+        return pa->key < pb->key ? -1 : 1;
+    return pa->value < pb->value ? -1 : pa->value > pb->value;
 }
 
+// pairs are sorted, those going to the same leaf are merged into it at once.
+// a leaf is filled until one key more than max_keys and split, the rest go
+// on after a new descent. otherwise the next leaf is found from the lowest
+// node shared with the path of the last one.
+void bt_insert_batch(BTree *bt, const uint64_t *keys, const uint64_t *values, size_t n)
+{
+    BTreePair  *pairs;
+    BTreePath   path;
+    BTreeNode  *leaf;
+    uint64_t    i, k, run, count;
+    int         append;
 
+    if (n == 0)
+        return;
 
+    pairs = (BTreePair *)malloc(sizeof(BTreePair) * n);
+    for (i = 0; i < n; i++)
+    {
+        pairs[i].key = keys[i];
+        pairs[i].value = values[i];
+    }
+    qsort(pairs, n, sizeof(BTreePair), bt_compare_pair);
 
-/////////////////////////////////////////////////
-//  BTree
-/////////////////////////////////////////////////
+    path.depth = 0;
+    i = 0;
+    while (i < n)
+    {
+        bt_path_seek(bt, &path, pairs[i].key);
+        leaf = path.steps[path.depth - 1].node;
+        count = bt_node_get_key_count(leaf);
+
+        run = bt_path_count_run(&path, pairs + i, n - i);
+        if (run > bt_get_max_keys(bt) + 1 - count)
+            run = bt_get_max_keys(bt) + 1 - count;
+        append = count == 0 || pairs[i].key > bt_node_get_key(leaf, count - 1);
+
+        // a run is logged as it is merged, a checkpoint between runs
+        // drops only records already in the tree
+        for (k = i; bt->log && k < i + run; k++)
+            bt_log_append(bt->log, BT_LOG_INSERT, pairs[k].key, pairs[k].value);
+        bt_node_marked_dirty(leaf);
+        bt_node_blk_leaf_merge(leaf->blk, pairs + i, run);
+        bt_path_add_count(bt, &path, run);
+        i += run;
+        if (count + run > bt_get_max_keys(bt))
+        {
+            bt_path_split(bt, &path, path.depth - 1, append);
+            bt_path_release(&path);
+        }
+        else
+        {
+            bt_append_path_keep(bt, &path);
+        }
 
-static uint64_t bt_get_max_keys(BTree *bt)
-{
-    return bt->max_keys;
+        bt_pool_balance(bt->pool);
+    }
+    bt_path_release(&path);
+    free(pairs);
+    bt_balance(bt);
 }
 
-static uint64_t bt_get_min_keys(BTree *bt)
+// delete all pairs of key, or the first one of key and value. return
+// pairs deleted. it is not logged, and pool is not balanced.
+static uint64_t bt_delete_pairs(BTree *bt, uint64_t key, uint64_t value, int all)
 {
-    return bt->min_keys;
-}
+    BTreePath   path;
+    BTreeNode  *leaf;
+    uint64_t    pos, end, count, deleted;
 
-static uint64_t bt_get_order(BTree *bt)
-{
-    return bt_meta_get_order(bt->meta);
-}
+    deleted = 0;
+    bt_search_leaf(bt, key, &path);
+    for (;;)
+    {
+        leaf = path.steps[path.depth - 1].node;
+        count = bt_node_get_key_count(leaf);
+        pos = bt_node_blk_leaf_search(leaf->blk, key);
+        end = pos;
+        while (end < count && bt_node_get_key(leaf, end) == key)
+        {
+            if (!all && bt_node_get_value(leaf, end) == value)
+                break;
+            end++;
+        }
 
-static uint64_t bt_get_blksize(BTree *bt)
-{
-    return bt_meta_get_blksize(bt->meta);
+        if (!all && end < count && bt_node_get_key(leaf, end) == key)
+        {
+            bt_node_marked_dirty(leaf);
+            bt_node_blk_leaf_remove(leaf->blk, end, 1);
+            bt_path_add_count(bt, &path, -1);
+            bt_path_rebalance(bt, &path, path.depth - 1);
+            return 1;
+        }
+        if (all && end > pos)
+        {
+            bt_node_marked_dirty(leaf);
+            bt_node_blk_leaf_remove(leaf->blk, pos, end - pos);
+            bt_path_add_count(bt, &path, -(int64_t)(end - pos));
+            bt_path_rebalance(bt, &path, path.depth - 1);
+            deleted += end - pos;
+        }
+
+        // keys after it are here, or equal keys may go on in next leaf
+        if (end < count)
+            return deleted;
+        if (all && end > pos)
+            bt_search_leaf(bt, key, &path);
+        else if (!bt_path_next_leaf(&path))
+            return deleted;
+    }
 }
 
-static uint64_t bt_get_max_blkid(BTree *bt)
+uint64_t bt_delete(BTree *bt, uint64_t key)
 {
-    return bt_meta_get_maxblkid(bt->meta);
+    uint64_t n;
+
+    if (bt->log)
+        bt_log_append(bt->log, BT_LOG_DELETE_KEY, key, 0);
+    n = bt_delete_pairs(bt, key, 0, 1);
+    bt_balance(bt);
+    return n;
 }
 
-static uint64_t bt_next_blkid(BTree *bt)
+int bt_delete_value(BTree *bt, uint64_t key, uint64_t value)
 {
-    return bt_meta_next_blkid(bt->meta);
+    uint64_t n;
+
+    if (bt->log)
+        bt_log_append(bt->log, BT_LOG_DELETE, key, value);
+    n = bt_delete_pairs(bt, key, value, 0);
+    bt_balance(bt);
+    return n;
 }
 
-static uint64_t bt_get_root_blkid(BTree *bt)
+void bt_commit(BTree *bt)
 {
-    return bt_meta_get_root_blkid(bt->meta);
+    if (bt->log)
+        bt_log_commit(bt->log);
+    else
+        bt_flush(bt);
 }
 
-static void bt_set_node(BTree *bt, uint64_t blkid, BTreeNode *node)
+// redo changes logged after last checkpoint, then make a new checkpoint.
+// the pool is not balanced until then, replayed nodes are not written
+// before the checkpoint.
+static void bt_recover(BTree *bt)
 {
+    BTreeLogRecord *records;
+    BTreePath       path;
+    uint64_t        i, n;
 
-    uint64_t max_blkid;
-    max_blkid = bt_get_max_blkid(bt);
-
-    assert(blkid <= max_blkid);
-
+    n = bt_log_read(bt->log, bt_meta_get_generation(bt->meta), &records);
+    for (i = 0; i < n; i++)
+    {
+        switch (bt_log_record_op(bt_meta_get_generation(bt->meta), &records[i]))
+        {
+        case BT_LOG_INSERT:
+            bt_search_leaf(bt, records[i].key, &path);
+            bt_path_leaf_insert(bt, &path, records[i].key, records[i].value);
+            break;
+        case BT_LOG_DELETE:
+            bt_delete_pairs(bt, records[i].key, records[i].value, 0);
+            break;
+        case BT_LOG_DELETE_KEY:
+            bt_delete_pairs(bt, records[i].key, 0, 1);
+            break;
+        }
+    }
+    free(records);
 
-    // TODO....  only realloc if really needed
-    if(blkid == max_blkid)
-        bt->blkid_to_node = (BTreeNode **)realloc(bt->blkid_to_node, sizeof(BTreeNode *) * (max_blkid + 1));
-    bt->blkid_to_node[blkid] = node;
+    // force a new checkpoint, it resets the log
+    bt->meta->dirty = 1;
+    bt_flush(bt);
+    bt_pool_balance(bt->pool);
 }
 
-static BTreeNode *bt_get_node(BTree *bt, uint64_t blkid)
+// state of a bulk load
+typedef struct {
+    uint64_t   *keys;           // pairs not put in a leaf yet
+    uint64_t   *values;
+    uint64_t    counts;
+    BTreeNode  *leaf;           // last leaf put, pinned to link the next one
+    // last key, blkid and pairs under each node of the level built last
+    uint64_t   *seps;
+    uint64_t   *blkids;
+    uint64_t   *sizes;
+    uint64_t    nodes;
+    uint64_t    seps_size;
+    uint64_t    blkids_size;
+    uint64_t    sizes_size;
+} BTreeBulk;
+
+// entries given to the next node of a level: fill of them, but the last
+// node never gets less than min nor more than capacity.
+static uint64_t bt_bulk_next_fill(uint64_t remaining, uint64_t fill, uint64_t capacity, uint64_t min)
 {
-    uint64_t max_blkid;
-    max_blkid = bt_get_max_blkid(bt);
-
-    assert(blkid <= max_blkid);
+    if (remaining >= fill + min)
+        return fill;
+    if (remaining <= capacity)
+        return remaining;
+    return remaining / 2;
+}
 
-    // TODO....  only realloc if really needed
-    if (bt->blkid_to_node[blkid] == NULL)
-        bt_node_new_from_file(bt, blkid);
+// put the first n buffered pairs in a leaf right to the last one.
+// the first leaf is the empty root.
+static void bt_bulk_put_leaf(BTree *bt, BTreeBulk *bulk, uint64_t n)
+{
+    BTreeNode *leaf;
 
-    return bt->blkid_to_node[blkid];
+    if (bulk->leaf == NULL)
+    {
+        leaf = bt->root;
+    }
+    else
+    {
+        leaf = bt_node_new_empty(bt, BT_NODE_TYPE_LEAF);
+        bt_node_link_sibling(bulk->leaf, leaf);
+        bt_node_unpin(bulk->leaf);
+    }
+    memcpy(bt_node_blk_keys(leaf->blk), bulk->keys, n * sizeof(uint64_t));
+    memcpy(bt_node_blk_slots(leaf->blk), bulk->values, n * sizeof(uint64_t));
+    bt_node_set_key_count(leaf, n);
+    bt_node_pin(leaf);
+    bulk->leaf = leaf;
+
+    bt_array_reserve((void **)&bulk->seps, &bulk->seps_size, bulk->nodes + 1, sizeof(uint64_t), 1024);
+    bt_array_reserve((void **)&bulk->blkids, &bulk->blkids_size, bulk->nodes + 1, sizeof(uint64_t), 1024);
+    bulk->seps[bulk->nodes] = bulk->keys[n - 1];
+    bulk->blkids[bulk->nodes] = leaf->blkid;
+    bt_array_reserve((void **)&bulk->sizes, &bulk->sizes_size, bulk->nodes + 1, sizeof(uint64_t), 1024);
+    bulk->sizes[bulk->nodes] = n;
+    bulk->nodes++;
+
+    bulk->counts -= n;
+    memmove(bulk->keys, bulk->keys + n, bulk->counts * sizeof(uint64_t));
+    memmove(bulk->values, bulk->values + n, bulk->counts * sizeof(uint64_t));
+
+    // leaves before are done, written in blkid order when evicted
+    bt_pool_balance(bt->pool);
 }
 
-static void bt_open_file(BTree *bt)
+// build none leaf levels over the leaves, until one node is left.
+// a level is rewritten in place by the level above it.
+static void bt_bulk_put_levels(BTree *bt, BTreeBulk *bulk, uint64_t fill)
 {
-    if(bt->file_fd == -1)
+    BTreeNode *node;
+    uint64_t  *counts;
+    uint64_t   i, j, n, next, size;
+
+    while (bulk->nodes > 1)
     {
-        bt->file_fd = open(bt->file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        next = 0;
+        for (i = 0; i < bulk->nodes; i += n)
+        {
+            n = bt_bulk_next_fill(bulk->nodes - i, fill, bt_get_max_keys(bt) + 1, bt_get_min_keys(bt) + 1);
+            node = bt_node_new_empty(bt, BT_NODE_TYPE_INTERNAL);
+            memcpy(bt_node_blk_keys(node->blk), bulk->seps + i, (n - 1) * sizeof(uint64_t));
+            memcpy(bt_node_blk_slots(node->blk), bulk->blkids + i, n * sizeof(uint64_t));
+            bt_node_set_key_count(node, n - 1);
+            size = 0;
+            for (j = 0; j < n; j++)
+                size += bulk->sizes[i + j];
+            counts = bt_node_get_counts(node);
+            if (counts)
+                memcpy(counts, bulk->sizes + i, n * sizeof(uint64_t));
+
+            bulk->seps[next] = bulk->seps[i + n - 1];
+            bulk->blkids[next] = node->blkid;
+            bulk->sizes[next] = size;
+            next++;
+            bt_pool_balance(bt->pool);
+        }
+        bulk->nodes = next;
     }
-    assert(bt->file_fd != -1);
 }
 
-static void bt_load_blk(BTree *bt, void *dst, uint64_t blkid)
+int bt_bulk_load(BTree *bt, BTreeBulkNext next, void *arg, uint64_t fill)
 {
-    ssize_t   rtv;
-    uint64_t  blksize;
+    BTreeBulk   bulk;
+    BTreeLog   *log;
+    BTreeNode  *root;
+    uint64_t    leaf_fill, node_fill;
+    uint64_t    key, value, last, pairs;
+
+    if (!(bt_node_get_type(bt->root) & BT_NODE_TYPE_LEAF) || bt_node_get_key_count(bt->root) > 0)
+        return -1;
+    bt_append_path_drop(bt);
+
+    if (fill == 0 || fill > 100)
+        fill = 100;
+    leaf_fill = bt_get_max_keys(bt) * fill / 100;
+    if (leaf_fill < bt_get_min_keys(bt))
+        leaf_fill = bt_get_min_keys(bt);
+    node_fill = (bt_get_max_keys(bt) + 1) * fill / 100;
+    if (node_fill < bt_get_min_keys(bt) + 1)
+        node_fill = bt_get_min_keys(bt) + 1;
+
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.keys = (uint64_t *)malloc(sizeof(uint64_t) * (leaf_fill + bt_get_min_keys(bt)));
+    bulk.values = (uint64_t *)malloc(sizeof(uint64_t) * (leaf_fill + bt_get_min_keys(bt)));
+
+    // pairs are not logged, so nodes evicted are written in place as if
+    // there were no log. the checkpoint at the end makes them durable.
+    log = bt->log;
+    bt->log = NULL;
+
+    // keep min_keys pairs buffered, so the last leaf can be filled enough
+    last = 0;
+    pairs = 0;
+    while (next(arg, &key, &value))
+    {
+        assert(pairs == 0 || key >= last);
+        if (bulk.counts == leaf_fill + bt_get_min_keys(bt))
+            bt_bulk_put_leaf(bt, &bulk, leaf_fill);
+        bulk.keys[bulk.counts] = key;
+        bulk.values[bulk.counts] = value;
+        bulk.counts++;
+        last = key;
+        pairs++;
+    }
+    while (bulk.counts > 0)
+        bt_bulk_put_leaf(bt, &bulk, bt_bulk_next_fill(bulk.counts, leaf_fill, bt_get_max_keys(bt), bt_get_min_keys(bt)));
+    if (bulk.leaf)
+        bt_node_unpin(bulk.leaf);
 
-    // when load Meta block, blksize is unknown
-    if (blkid == 0)
-        blksize = sizeof(BTreeMetaBlk);
-    else
-        blksize = bt_get_blksize(bt);
-    
-    bt_open_file(bt);
-    rtv = lseek(bt->file_fd, blkid * blksize, SEEK_SET);
-    assert(rtv == blkid * blksize);
-    rtv = read(bt->file_fd, dst, blksize);
-    assert(rtv == blksize);
+    if (bulk.nodes > 1)
+    {
+        bt_node_set_type(bt->root, BT_NODE_TYPE_LEAF);
+        bt_bulk_put_levels(bt, &bulk, node_fill);
+        root = bt_get_node(bt, bulk.blkids[0]);
+        bt_node_set_type(root, BT_NODE_TYPE_ROOT);
+        bt_set_root(bt, root);
+        bt_set_root_blkid(bt, root->blkid);
+    }
 
+    free(bulk.keys);
+    free(bulk.values);
+    free(bulk.seps);
+    free(bulk.blkids);
+    free(bulk.sizes);
+
+    bt->log = log;
+    if (bt->log)
+        bt_flush(bt);
+    bt_pool_balance(bt->pool);
+    return 0;
 }
 
-static void bt_store_blk(BTree *bt, uint64_t blkid)
+// pairs of the old tree given to bt_bulk_load by compaction
+static int bt_compact_next_pair(void *arg, uint64_t *key, uint64_t *value)
 {
-    ssize_t   rtv;
-    uint64_t  blksize;
-    void     *blk;
-
-    if(blkid == 0)
-        blk = (void *)bt->meta->blk;
-    else
-        blk = (void *)bt->blkid_to_node[blkid]->blk;
-    
+    BTreeCursor *cursor = (BTreeCursor *)arg;
 
-    blksize = bt_get_blksize(bt);
-    bt_open_file(bt);
-    rtv = lseek(bt->file_fd, blkid * blksize, SEEK_SET);
-    assert(rtv == blkid * blksize);
-    rtv = write(bt->file_fd, blk, blksize);
-    assert(rtv == blksize);
+    if (cursor->leaf == NULL)
+        return 0;
+    *key = bt_cursor_key(cursor);
+    *value = bt_cursor_value(cursor);
+    bt_cursor_next(cursor);
+    return 1;
 }
 
-static void bt_load_meta(BTree *bt)
+// make a rename in directory of file durable
+static void bt_sync_dir(const char *file)
 {
-    BTreeMeta   *meta;
-    
-    meta = bt_meta_new_from_file(bt);
-
-    bt->meta = meta;
+    char    *dir, *slash;
+    int      fd, rtv;
+
+    dir = (char *)malloc(strlen(file) + 2);
+    strcpy(dir, file);
+    slash = strrchr(dir, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    fd = open(dir, O_RDONLY);
+    assert(fd != -1);
+    rtv = fsync(fd);
+    assert(rtv == 0);
+    close(fd);
+    free(dir);
 }
 
-static void bt_load_root(BTree *bt)
+// drop all nodes of bt from its pool, they must be clean and unpinned
+static void bt_destory_nodes(BTree *bt)
 {
-    uint64_t      root_blk_id;
-    BTreeNode    *root;
-   
-    root_blk_id = bt_get_root_blkid(bt);
-    root = bt_node_new_from_file(bt, root_blk_id);
-    
-    bt->root = root;
+    uint64_t i;
+
+    for(i = 0; i < bt->nodes.size; i++)
+    {
+        if(bt->nodes.slots[i])
+            bt_node_destory(bt->nodes.slots[i]);
+    }
 }
 
-static BTree *bt_new_from_file(const char *file)
+// the tree is written by bulk load into <file>.compact, which is renamed
+// over file at last. a crash before leaves the old file untouched.
+// the new file is given the generation of the old one, which its bt_flush
+// bumps like any checkpoint. the log, emptied by the flush of the old file,
+// is of an older generation then and is never replayed over the new file.
+void bt_compact(BTree *bt, uint64_t fill)
 {
-    BTree    *bt;
-    uint64_t  order;
-    
-    bt = (BTree *)malloc(sizeof(BTree));
-    INIT_LIST_HEAD(&bt->deleted_node_chain);
-    INIT_LIST_HEAD(&bt->new_node_chain);
-    INIT_LIST_HEAD(&bt->dirty_node_chain);
-    bt->file_path = (char *)malloc(strlen(file) + 1);
-    strcpy(bt->file_path, file);
+    BTree            *new_bt;
+    BTreeOpenFlag     flag;
+    BTreeCursor      *cursor;
+    char             *new_file;
+    int               rtv;
+
+    bt_flush(bt);
+    bt_append_path_drop(bt);
+
+    new_file = (char *)malloc(strlen(bt->file_path) + sizeof(".compact"));
+    strcpy(new_file, bt->file_path);
+    strcat(new_file, ".compact");
+    unlink(new_file);
+
+    memset(&flag, 0, sizeof(flag));
+    flag.file = new_file;
+    flag.order = bt_get_order(bt);
+    flag.pool = bt->pool;
+    flag.io = bt->io->backend;
+    flag.shadow = bt->shadow != NULL;
+    flag.counted = bt_meta_is_counted(bt->meta);
+    new_bt = bt_new_empty(&flag);
+    new_bt->log = NULL;
+
+    cursor = bt_cursor_new(bt);
+    bt_cursor_seek(cursor, 0);
+    rtv = bt_bulk_load(new_bt, bt_compact_next_pair, cursor, fill);
+    assert(rtv == 0);
+    bt_cursor_close(cursor);
+
+    bt_meta_set_generation(new_bt->meta, bt_meta_get_generation(bt->meta));
+    bt_flush(new_bt);
+    rtv = fsync(new_bt->file_fd);
+    assert(rtv == 0);
+    bt_close(new_bt);
+
+    rtv = rename(new_file, bt->file_path);
+    assert(rtv == 0);
+    bt_sync_dir(bt->file_path);
+    free(new_file);
+
+    // forget the old file, load the new one as bt_open does
+    bt_destory_nodes(bt);
+    bt_node_table_destory(&bt->nodes);
+    bt_meta_destory(bt->meta);
+    if (bt->shadow)
+        bt_shadow_destory(bt->shadow);
+    bt->shadow = NULL;
+    bt->root = NULL;
+    close(bt->file_fd);
     bt->file_fd = -1;
-    bt_load_meta(bt);
-    order = bt_get_order(bt);
-    bt->max_keys = order - 1;
-    bt->min_keys = order / 2;
-    // node blk id start from 1
-    bt->blkid_to_node = (BTreeNode **)malloc(sizeof(BTreeNode *) * (bt_get_max_blkid(bt) + 1));
-    memset(bt->blkid_to_node, 0, sizeof(BTreeNode *)*(bt_get_max_blkid(bt) + 1));
 
+    bt_load_meta(bt);
+    if (bt->meta->blk->version == BTREE_FILE_VERSION_SHADOW)
+        bt_load_shadow_map(bt);
+    bt_node_table_init(&bt->nodes, BT_NODE_TABLE_MIN_SIZE);
     bt_load_root(bt);
-
-    return bt;
+    bt->flush_stat.generation = bt_meta_get_generation(bt->meta);
+    if (bt->log)
+        bt_log_reset(bt->log, bt_meta_get_generation(bt->meta));
+    bt_pool_balance(bt->pool);
 }
 
-static BTree *bt_new_empty(const char *file, uint64_t order)
+// fetch values of keys in [key_min, key_max], at most limit of them, into
+// values if given, otherwise into out, or only count them if out is NULL.
+// return number fetched.
+static uint64_t bt_search_range_fetch(BTree *bt, uint64_t key_min, uint64_t key_max,
+                                      BTreeValues *values, uint64_t *out, uint64_t limit)
 {
-    uint64_t      blksize;
-    BTree        *bt;
-    
-    bt = (BTree *)malloc(sizeof(BTree));
- 
-    INIT_LIST_HEAD(&bt->deleted_node_chain);
-    INIT_LIST_HEAD(&bt->new_node_chain);
-    INIT_LIST_HEAD(&bt->dirty_node_chain);
+    BTreeNode   *leaf;
+    BTreePath    path;
+    uint64_t     right, counts, n;
+    int          more;
 
-    bt->file_path = (char *)malloc(strlen(file) + 1);
-    strcpy(bt->file_path, file);
-    bt->file_fd = -1;
-    bt->max_keys = order - 1;
-    bt->min_keys = order / 2;
+    counts = 0;
+    leaf = bt_search_leaf(bt, key_min, &path);
 
-    blksize = sizeof(BTreeNodeBlk) + (order * 2 - 1) * sizeof(uint64_t);
-    assert(blksize >= sizeof(BTreeMetaBlk));
+    while (counts < limit)
+    {
+        if (values)
+        {
+            n = counts + bt_node_get_key_count(leaf);
+            bt_values_reserve(values, n < limit ? n : limit);
+            out = values->values;
+        }
+        counts += bt_node_leaf_fetch(leaf, out ? out + counts : NULL, limit - counts, key_min, key_max, &more);
+        if (values)
+            values->counts = counts;
+        if (!more)
+            break;
 
-    bt->meta = bt_meta_new_empty(order, blksize);
+        // only the leaf is held, a long scan doesn't grow the pool
+        bt_node_pin(leaf);
+        bt_pool_balance(bt->pool);
 
-    bt->blkid_to_node = (BTreeNode **)malloc(sizeof(BTreeNode *) * (bt_get_max_blkid(bt) + 1));
-    memset(bt->blkid_to_node, 0, bt_get_max_blkid(bt) + 1);
+        // next leaf is not in memory, read ahead some leaves at once
+        right = bt_node_blk_get_right_sibling_blkid(leaf->blk);
+        if (right && bt_node_table_get(&bt->nodes, right) == NULL)
+            bt_path_prefetch_leaves(bt, leaf, path.depth, 0);
+        bt_node_unpin(leaf);
 
-    bt->root = bt_node_new_empty(bt, BT_NODE_TYPE_LEAF | BT_NODE_TYPE_ROOT);
+        leaf = bt_node_get_right_sibling(leaf);
+        if (leaf == NULL)
+            break;
+    }
 
-    return bt;
+    bt_pool_balance(bt->pool);
+    return counts;
 }
 
-void bt_flush(BTree *bt)
+BTreeValues *bt_search_range(BTree *bt, uint64_t limit, uint64_t key_min, uint64_t key_max)
 {
-    BTreeNode *node;
+    BTreeValues *values;
 
-    if(bt->meta->dirty)
-        bt_store_blk(bt, 0);
+    values = bt_values_new();
+    bt_values_reserve(values, limit < BT_VALUES_RESERVE_MAX ? limit : BT_VALUES_RESERVE_MAX);
+    bt_search_range_fetch(bt, key_min, key_max, values, NULL, limit);
+    return values;
+}
 
-    list_for_each_entry(node, &bt->new_node_chain, chain)
-        bt_store_blk(bt, bt_node_get_blkid(node));
+BTreeValues *bt_search(BTree *bt, uint64_t limit, uint64_t key)
+{
+    return bt_search_range(bt, limit, key, key);
+}
 
-    list_for_each_entry(node, &bt->dirty_node_chain, chain)
-        bt_store_blk(bt, bt_node_get_blkid(node));
+// leaves are walked from key_max to left, values of a leaf are a run
+// copied backwards.
+BTreeValues *bt_search_range_desc(BTree *bt, uint64_t limit, uint64_t key_min, uint64_t key_max)
+{
+    BTreeValues *values;
+    BTreeCursor *cursor;
+    BTreeNode   *leaf;
+    uint64_t    *slots;
+    uint64_t     first, i, n;
+    int          more;
+
+    values = bt_values_new();
+    bt_values_reserve(values, limit < BT_VALUES_RESERVE_MAX ? limit : BT_VALUES_RESERVE_MAX);
+    cursor = bt_cursor_new(bt);
+    more = key_min <= key_max && bt_cursor_seek_last(cursor, key_max);
+    while (more && values->counts < limit)
+    {
+        leaf = cursor->leaf;
+        first = bt_node_blk_leaf_search(leaf->blk, key_min);
+        if (first > cursor->index)
+            break;
+
+        n = cursor->index + 1 - first;
+        if (n > limit - values->counts)
+            n = limit - values->counts;
+        bt_values_reserve(values, values->counts + n);
+        slots = bt_node_blk_slots(leaf->blk);
+        for (i = 0; i < n; i++)
+            values->values[values->counts + i] = slots[cursor->index - i];
+        values->counts += n;
+
+        // keys left to first are less than key_min
+        if (first > 0)
+            break;
+        cursor->index = 0;
+        more = bt_cursor_prev(cursor);
+    }
+    bt_cursor_close(cursor);
 
+    bt_pool_balance(bt->pool);
+    return values;
 }
 
-void bt_insert(BTree *bt, uint64_t key, uint64_t value)
+size_t bt_search_range_into(BTree *bt, uint64_t key_min, uint64_t key_max, uint64_t *out, size_t cap)
 {
-    BTreeNode  *leaf;
-
-    leaf = bt_node_search(bt->root, key);
-    bt_node_leaf_insert(leaf, key, value);   
-    
-    assert(bt_node_get_key_count(leaf) <= bt->max_keys);
+    return bt_search_range_fetch(bt, key_min, key_max, NULL, out, cap);
 }
 
-BTreeValues *bt_search_range(BTree *bt, uint64_t limit, uint64_t key_min, uint64_t key_max)
+size_t bt_search_into(BTree *bt, uint64_t key, uint64_t *out, size_t cap)
 {
-    BTreeNode   *leaf;
-    BTreeValues *values;
-    int          remind;
-    int          b_continue;
+    return bt_search_range_fetch(bt, key, key, NULL, out, cap);
+}
 
-    values = bt_values_new();
-    leaf = bt_node_search(bt->root, key_min);
+// probes are searched in key order by one path, see bt_path_seek. a probe
+// in the leaf of the last one doesn't descend at all, one in a leaf next to
+// it searches their parent only. values of a key going on in next leaves
+// are read along the leaf chain.
+BTreeValues *bt_search_batch(BTree *bt, const uint64_t *keys, size_t n, uint64_t limit, uint64_t *counts)
+{
+    BTreePair   *probes;        // key and its index in keys
+    BTreeValues *found, *values;
+    BTreePath    path;
+    BTreeNode   *leaf, *next;
+    uint64_t    *starts;        // of values of keys[i] in found
+    uint64_t     i, j, c, room;
+    int          more;
+
+    probes = (BTreePair *)malloc(sizeof(BTreePair) * (n + 1));
+    starts = (uint64_t *)malloc(sizeof(uint64_t) * (n + 1));
+    for (i = 0; i < n; i++)
+    {
+        probes[i].key = keys[i];
+        probes[i].value = i;
+    }
+    qsort(probes, n, sizeof(BTreePair), bt_compare_pair);
 
-    do
+    found = bt_values_new();
+    path.depth = 0;
+    for (i = 0; i < n; i++)
     {
-        remind = limit - bt_values_get_count(values);
-        b_continue = bt_node_leaf_fetch_values(leaf, values, remind, key_min, key_max);
+        j = probes[i].value;
+        if (i > 0 && probes[i].key == probes[i - 1].key)
+        {
+            starts[j] = starts[probes[i - 1].value];
+            counts[j] = counts[probes[i - 1].value];
+            continue;
+        }
 
-        leaf = bt_node_get_right_sibling(leaf);
-        if(leaf == NULL)
-            break;
+        bt_path_seek(bt, &path, probes[i].key);
+        starts[j] = found->counts;
+        c = 0;
+        leaf = path.steps[path.depth - 1].node;
+        bt_node_pin(leaf);
+        while (c < limit)
+        {
+            room = bt_node_get_key_count(leaf);
+            bt_values_reserve(found, found->counts + (room < limit - c ? room : limit - c));
+            room = bt_node_leaf_fetch(leaf, found->values + found->counts, limit - c,
+                                      probes[i].key, probes[i].key, &more);
+            found->counts += room;
+            c += room;
+            if (!more)
+                break;
+
+            // path stays at the first leaf, later probes seek from there
+            next = bt_node_get_right_sibling(leaf);
+            if (next == NULL)
+                break;
+            bt_node_pin(next);
+            bt_node_unpin(leaf);
+            leaf = next;
+        }
+        bt_node_unpin(leaf);
+        counts[j] = c;
+
+        bt_pool_balance(bt->pool);
+    }
+    bt_path_release(&path);
 
-    } while (b_continue);
+    // values in order of keys, those of a key given more than once are
+    // copied for each
+    c = 0;
+    for (i = 0; i < n; i++)
+        c += counts[i];
+    values = bt_values_new();
+    bt_values_reserve(values, c);
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < counts[i]; j++)
+            values->values[values->counts + j] = found->values[starts[i] + j];
+        values->counts += counts[i];
+    }
 
+    bt_values_destory(found);
+    free(starts);
+    free(probes);
+    bt_pool_balance(bt->pool);
     return values;
 }
 
-BTreeValues *bt_search(BTree *bt, uint64_t limit, uint64_t key)
+uint64_t bt_count_range(BTree *bt, uint64_t key_min, uint64_t key_max)
 {
-    return bt_search_range(bt, limit, key, key);
+    uint64_t n;
+
+    if (key_min > key_max)
+        return 0;
+    if (!bt_meta_is_counted(bt->meta))
+        return bt_search_range_fetch(bt, key_min, key_max, NULL, NULL, UINT64_MAX);
+
+    if (key_max == UINT64_MAX)
+        n = bt_node_get_size(bt->root);
+    else
+        n = bt_count_less(bt, key_max + 1);
+    n -= bt_count_less(bt, key_min);
+    bt_pool_balance(bt->pool);
+    return n;
+}
+
+int bt_select(BTree *bt, uint64_t rank, uint64_t *key, uint64_t *value)
+{
+    BTreeNode *leaf;
+    uint64_t   index, depth;
+
+    leaf = bt_search_rank(bt, rank, &index, &depth);
+    if (leaf)
+    {
+        *key = bt_node_get_key(leaf, index);
+        *value = bt_node_get_value(leaf, index);
+        bt_node_unpin(leaf);
+    }
+    bt_pool_balance(bt->pool);
+    return leaf != NULL;
 }
 
 BTree * bt_open(BTreeOpenFlag flag)
 {
+    BTree *bt;
+
     assert(flag.file);
     if(access(flag.file, F_OK) != -1)
     {
         if(flag.error_if_exist)
             return NULL;
-        return bt_new_from_file(flag.file);
+        bt_upgrade_legacy_file(flag.file);
+        bt = bt_new_from_file(&flag);
     }
     else
     {
@@ -1240,28 +4839,47 @@ BTree * bt_open(BTreeOpenFlag flag)
             return NULL;
         if(flag.order % 2 != 1 || flag.order < 3)
             return NULL;
-        return bt_new_empty(flag.file, flag.order);
+        bt = bt_new_empty(&flag);
+    }
+
+    // an empty tree is recovered too, records of a tree once in the same
+    // file are dropped since generation differs
+    bt->log = NULL;
+    if (flag.wal)
+    {
+        bt->log = bt_log_open(flag.file, flag.wal_group);
+        bt_recover(bt);
     }
+    return bt;
 }
 
 void bt_close(BTree *bt)
 {
-    uint64_t i;
-
     // flush tree to disk
     bt_flush(bt);
+    bt_append_path_drop(bt);
+    if (bt->log)
+        bt_log_close(bt->log);
 
-    // destory loaded node
-    for(i = 1; i <= bt_get_max_blkid(bt); i++)
+    // destory loaded node. a private pool holds nothing else, its slabs are
+    // freed at once. in a shared pool nodes are given back one by one.
+    if (bt->own_pool)
+    {
+        bt_pool_release(bt->pool);
+    }
+    else
     {
-        if(bt->blkid_to_node[i])
-            bt_node_destory(bt->blkid_to_node[i]);
+        bt_destory_nodes(bt);
     }
     // destory meta     
     bt_meta_destory(bt->meta);
 
 
-    free(bt->blkid_to_node);
+    bt_node_table_destory(&bt->nodes);
+    if (bt->shadow)
+        bt_shadow_destory(bt->shadow);
+    if (bt->file_fd != -1)
+        close(bt->file_fd);
     free(bt->file_path);
     free(bt);
 }
@@ -1286,7 +4904,7 @@ void bt_node_print(BTreeNode* node)
         printf("ROOT");
 
 
-    printf("]P: %lu, L: %lu, R: %lu, #K: %lu\n|",node->blk->parent_blkid, node->blk->left_sibling_blkid, node->blk->right_sibling_blkid, node->blk->key_counts);
+    printf("]L: %lu, R: %lu, #K: %lu\n|", node->blk->left_sibling_blkid, node->blk->right_sibling_blkid, node->blk->key_counts);
     if(!(node->blk->type & BT_NODE_TYPE_LEAF)) 
     {
         for (i = 0; i < node->blk->key_counts; i++)
@@ -1311,6 +4929,16 @@ void bt_node_print(BTreeNode* node)
     }
 }
 
+const char *bt_get_io_backend(BTree *bt)
+{
+    return bt->io->name;
+}
+
+void bt_get_cache_stat(BTree *bt, BTreeCacheStat *stat)
+{
+    bt_pool_get_stat(bt->pool, stat);
+}
+
 void bt_print(BTree *bt)
 {
     printf("---------- Meta ----------\n");
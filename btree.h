@@ -18,6 +18,7 @@
 #ifndef __BTREE_H__
 #define __BTREE_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -28,24 +29,182 @@ uint64_t   bt_values_get_value(BTreeValues *values, uint64_t index);
 void       bt_values_destory(BTreeValues *values);
 
 
+typedef struct BTreeCacheStat {
+    uint64_t    capacity;       // bytes, 0 for unlimited
+    uint64_t    used;           // bytes used by nodes in memory
+    uint64_t    nodes;          // nodes in memory
+    uint64_t    hits;           // node accesses found in memory
+    uint64_t    misses;         // node accesses loaded from disk
+    uint64_t    evictions;
+    uint64_t    write_backs;    // dirty nodes written aside when evicted
+} BTreeCacheStat;
+
+// memory for nodes of one or more trees.
+// least recently used clean nodes are dropped first. dirty nodes are only
+// evicted in shadow mode, written aside. those of other trees stay until a
+// checkpoint, see bt_flush. trees sharing a pool must not be used
+// concurrently, and must be closed before the pool is destoryed.
+typedef struct _BTreePool BTreePool;
+
+// capacity: bytes, 0 for unlimited
+BTreePool *bt_pool_new(uint64_t capacity);
+void       bt_pool_get_stat(BTreePool *pool, BTreeCacheStat *stat);
+void       bt_pool_destory(BTreePool *pool);
+
+
+// zero the flag before setting fields, options added later default to 0.
 typedef struct BTreeOpenFlag {
     const char *file;
     uint64_t    order;
     int         create_if_missing;
     int         error_if_exist;
+    // nodes are kept in pool if given, otherwise in a private pool of
+    // cache_size bytes (0 for unlimited).
+    BTreePool  *pool;
+    uint64_t    cache_size;
+    // I/O backend of node blocks, one of BT_IO_*.
+    int         io;
+    // keep a redo log of inserts in <file>.wal, replayed by bt_open.
+    // wal_group records are appended and synced at once (0 for each insert).
+    int         wal;
+    uint64_t    wal_group;
+    // shadow paging, modified blocks are written aside and bt_flush is
+    // atomic. a file once opened with it always uses it.
+    int         shadow;
+    // none leaf nodes keep pairs under each child, bt_count_range and
+    // bt_select take O(log n). blocks are about half larger and an insert
+    // or delete dirties its whole path. only used when file is created.
+    int         counted;
 } BTreeOpenFlag;
 
+typedef struct BTreeFlushStat {
+    uint64_t    generation;     // checkpoint generation on disk
+    uint64_t    blocks;         // blocks written by last bt_flush
+    uint64_t    bytes;
+    uint64_t    writes;         // write requests of last bt_flush, one per extent
+    uint64_t    total_blocks;   // blocks written by bt_flush since open
+    uint64_t    total_bytes;
+} BTreeFlushStat;
+
 typedef struct _BTree       BTree;
 
+// BT_IO_AUTO (default) uses io_uring if kernel supports it, otherwise
+// blocking pread/pwrite (BT_IO_SYNC). BT_IO_URING falls back the same way.
+// io_uring submits a flush, or leaves read ahead by range scan, as one batch.
+// trees of a pool share one ring, a private pool opens one ring (a file
+// descriptor and locked memory) for its tree. a failed ring falls back to
+// blocking calls.
+#define BT_IO_AUTO   0
+#define BT_IO_SYNC   1
+#define BT_IO_URING  2
 BTree *bt_open(BTreeOpenFlag flag);
 void   bt_insert(BTree *bt, uint64_t key, uint64_t value);
-void   bt_flush(BTree *bt);
+// insert n pairs, faster than bt_insert one by one: pairs going to the same
+// leaf are merged into it together. values of equal keys may be kept in
+// another order than by bt_insert.
+void   bt_insert_batch(BTree *bt, const uint64_t *keys, const uint64_t *values, size_t n);
+// delete all values of key, return number of them.
+// nodes left less than half full take keys from a sibling or are merged
+// with it, blocks of merged nodes are used again by later inserts.
+uint64_t bt_delete(BTree *bt, uint64_t key);
+// delete a pair of key and value, return 1 if found, 0 if not.
+int    bt_delete_value(BTree *bt, uint64_t key, uint64_t value);
+// give the next pair of a bulk load, return 0 if there is no more.
+typedef int (*BTreeBulkNext)(void *arg, uint64_t *key, uint64_t *value);
+// build an empty tree from pairs given in key order, leaves are written one
+// after another and none leaf levels built on them. nodes are filled to
+// fill percent (0 for 100), at least half. much faster than bt_insert and
+// the file is smaller. pairs are not logged, with wal a checkpoint is made
+// at the end instead.
+// return 0 on success, -1 if tree is not empty.
+int    bt_bulk_load(BTree *bt, BTreeBulkNext next, void *arg, uint64_t fill);
+// rewrite the tree into a new file by bulk load, leaves one after another
+// in key order and filled to fill percent (0 for 100), so range scans read
+// the file sequentially. the new file replaces the old one atomically, a
+// crash before leaves the old one. modifications are made durable first.
+void   bt_compact(BTree *bt, uint64_t fill);
 void   bt_print(BTree *bt);
-// if crush befor bt_flush, any modification will be lost.
-// if crush inside bt_flush, the tree will be corrupted
+// write blocks modified since last bt_flush.
+// if crush befor bt_flush, any modification will be lost, unless logged
+// by wal and committed.
+// if crush inside bt_flush, the tree will be corrupted, unless in shadow
+// mode, where the tree of last bt_flush is kept.
+// with a bounded pool, nodes modified since the last checkpoint are not
+// evicted unless shadow is set. when they fill the pool, the tree makes a
+// checkpoint at the end of its own insert or delete, a crash then keeps
+// modifications up to it.
 void   bt_flush(BTree *bt);
+// make inserts so far durable: commit the log group if wal is enabled,
+// otherwise bt_flush.
+void   bt_commit(BTree *bt);
+void   bt_get_flush_stat(BTree *bt, BTreeFlushStat *stat);
+// bytes of blocks modified since last written
+uint64_t bt_get_dirty_bytes(BTree *bt);
+// write at most max_blocks oldest modified blocks without a checkpoint, so
+// a later bt_flush has less to do. return blocks written. blocks are only
+// written aside in shadow mode, otherwise nothing is written and bt_flush
+// writes them all.
+uint64_t bt_write_back(BTree *bt, uint64_t max_blocks);
 void   bt_close(BTree *bt);
 BTreeValues *bt_search(BTree *bt, uint64_t limit, uint64_t key);
 BTreeValues *bt_search_range(BTree *bt, uint64_t limit, uint64_t key_min, uint64_t key_max);
+// values of keys in [key_min, key_max] from key_max down, at most limit of
+// them: the reverse of bt_search_range. the last ones cost a descent and a
+// walk over left leaves.
+BTreeValues *bt_search_range_desc(BTree *bt, uint64_t limit, uint64_t key_min, uint64_t key_max);
+// same as above, values are copied to out instead, at most cap of them.
+// return number of values, nothing is allocated.
+size_t bt_search_into(BTree *bt, uint64_t key, uint64_t *out, size_t cap);
+size_t bt_search_range_into(BTree *bt, uint64_t key_min, uint64_t key_max, uint64_t *out, size_t cap);
+// look up n keys at once, at most limit values of each. keys are searched
+// in sorted order sharing the path from root, so keys close to each other
+// cost much less than a bt_search each. values are returned key by key in
+// the order of keys, counts[i] of them for keys[i].
+BTreeValues *bt_search_batch(BTree *bt, const uint64_t *keys, size_t n, uint64_t limit, uint64_t *counts);
+// number of pairs of keys in [key_min, key_max], and the pair at rank
+// (from 0) in key order. a counted tree takes a descent or two, others
+// walk leaves. bt_select returns 0 if there are not more pairs than rank.
+uint64_t bt_count_range(BTree *bt, uint64_t key_min, uint64_t key_max);
+int      bt_select(BTree *bt, uint64_t rank, uint64_t *key, uint64_t *value);
+
+// a cursor walks pairs in key order either way, reading leaves in place:
+// one leaf is held at a time and nothing is allocated per pair.
+// modifying the tree leaves a positioned cursor undefined until it is
+// seeked again. close cursors before bt_compact and bt_close.
+typedef struct _BTreeCursor BTreeCursor;
+BTreeCursor *bt_cursor_new(BTree *bt);
+// move to the first pair of key not less than key.
+// return 1 if there is one, 0 if past the last pair.
+int      bt_cursor_seek(BTreeCursor *cursor, uint64_t key);
+// move to the next pair, return 0 if past the last pair.
+int      bt_cursor_next(BTreeCursor *cursor);
+// move to the last pair of key not greater than key, walking backwards.
+// return 1 if there is one, 0 if before the first pair.
+int      bt_cursor_seek_last(BTreeCursor *cursor, uint64_t key);
+// move to the pair at rank (from 0) in key order, see bt_select.
+// return 0 if past the last pair.
+int      bt_cursor_seek_rank(BTreeCursor *cursor, uint64_t rank);
+// move to the previous pair, return 0 if before the first pair.
+int      bt_cursor_prev(BTreeCursor *cursor);
+uint64_t bt_cursor_key(BTreeCursor *cursor);
+uint64_t bt_cursor_value(BTreeCursor *cursor);
+void     bt_cursor_close(BTreeCursor *cursor);
+
+// stat of the pool used by bt
+void   bt_get_cache_stat(BTree *bt, BTreeCacheStat *stat);
+// name of I/O backend in use, "io_uring" or "sync"
+const char *bt_get_io_backend(BTree *bt);
+
+// how keys are searched inside a node. affects all trees, mainly for benchmark.
+// BT_SEARCH_AUTO (default) picks BT_SEARCH_SIMD if cpu supports (avx2 or sse4.2),
+// otherwise BT_SEARCH_BINARY.
+// return 0 on success, -1 if the kernel is not supported by this cpu.
+#define BT_SEARCH_AUTO    0
+#define BT_SEARCH_LINEAR  1
+#define BT_SEARCH_BINARY  2
+#define BT_SEARCH_SIMD    3
+int      bt_set_search_kernel(int kernel);
+// index of first key >= key in sorted keys[n], by the current kernel
+uint64_t bt_keys_lower_bound(const uint64_t *keys, uint64_t n, uint64_t key);
 
 #endif // __BTREE_H__
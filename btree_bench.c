@@ -0,0 +1,705 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+
+
+// all benchs use a tree in this file, created again for each run
+#define BENCH_FILE "./bench.bt"
+#define BENCH_WAL  "./bench.bt.wal"
+
+static uint64_t     orders[] = {3, 11, 31, 101, 501, 1001};
+static const char  *kernel_names[] = {"linear", "binary", "simd"};
+static int          kernels[] = {BT_SEARCH_LINEAR, BT_SEARCH_BINARY, BT_SEARCH_SIMD};
+
+static int compare_key(const void *a, const void *b)
+{
+    uint64_t ka = *(const uint64_t *)a;
+    uint64_t kb = *(const uint64_t *)b;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static BTreeOpenFlag bench_flag(uint64_t order)
+{
+    BTreeOpenFlag flag;
+
+    memset(&flag, 0, sizeof(flag));
+    flag.create_if_missing = 1;
+    flag.error_if_exist = 0;
+    flag.file = BENCH_FILE;
+    flag.order = order;
+    return flag;
+}
+
+static void bench_remove()
+{
+    unlink(BENCH_FILE);
+    unlink(BENCH_WAL);
+}
+
+// an empty tree in place of the last one
+static BTree *bench_create(BTreeOpenFlag flag)
+{
+    bench_remove();
+    return bt_open(flag);
+}
+
+// insert keys random keys below keys, each one its own value
+static void bench_fill(BTree *bt, uint64_t keys)
+{
+    uint64_t i, n;
+
+    srand(0);
+    for (i = 0; i < keys; i++)
+    {
+        n = rand() % keys;
+        bt_insert(bt, n, n);
+    }
+}
+
+static double bench_seconds(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// search kernel only, on a full node (order - 1 sorted keys)
+static void bench_kernel(uint64_t lookups)
+{
+    uint64_t  *keys, *probes;
+    uint64_t   i, n, sum;
+    int        o, j;
+    clock_t    time;
+
+    printf("kernel: %lu lookups in a full node\n", lookups);
+    printf("%8s %8s %10s\n", "order", "kernel", "seconds");
+    probes = (uint64_t *)malloc(sizeof(uint64_t) * lookups);
+    for (o = 0; o < sizeof(orders) / sizeof(orders[0]); o++)
+    {
+        n = orders[o] - 1;
+        keys = (uint64_t *)malloc(sizeof(uint64_t) * n);
+        srand(0);
+        for (i = 0; i < n; i++)
+            keys[i] = rand();
+        qsort(keys, n, sizeof(uint64_t), compare_key);
+        for (i = 0; i < lookups; i++)
+            probes[i] = rand();
+
+        for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); j++)
+        {
+            if (bt_set_search_kernel(kernels[j]) != 0)
+                continue;
+            sum = 0;
+            time = clock();
+            for (i = 0; i < lookups; i++)
+                sum += bt_keys_lower_bound(keys, n, probes[i]);
+            printf("%8lu %8s %10f (sum %lu)\n", orders[o], kernel_names[j],
+                   (float)(clock() - time) / CLOCKS_PER_SEC, sum);
+        }
+        free(keys);
+    }
+    bt_set_search_kernel(BT_SEARCH_AUTO);
+    free(probes);
+}
+
+// point lookup through the tree
+static void bench_tree(uint64_t keys, uint64_t lookups)
+{
+    uint64_t       k, n, found;
+    int            o, j;
+    clock_t        time;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+
+    flag = bench_flag(0);
+
+    printf("tree: %lu keys, %lu lookups\n", keys, lookups);
+    printf("%8s %8s %10s\n", "order", "kernel", "seconds");
+    for (o = 0; o < sizeof(orders) / sizeof(orders[0]); o++)
+    {
+        flag.order = orders[o];
+        bt = bench_create(flag);
+        bench_fill(bt, keys);
+
+        for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); j++)
+        {
+            if (bt_set_search_kernel(kernels[j]) != 0)
+                continue;
+            srand(1);
+            found = 0;
+            time = clock();
+            for (k = 0; k < lookups; k++)
+            {
+                n = rand() % keys;
+                values = bt_search(bt, 1, n);
+                found += bt_values_get_count(values);
+                bt_values_destory(values);
+            }
+            printf("%8lu %8s %10f (found %lu)\n", orders[o], kernel_names[j],
+                   (float)(clock() - time) / CLOCKS_PER_SEC, found);
+        }
+        bt_set_search_kernel(BT_SEARCH_AUTO);
+
+        bt_close(bt);
+    }
+    bench_remove();
+}
+
+// full range scan right after open, leaves are read from file
+static void bench_scan(uint64_t keys)
+{
+    int            j;
+    clock_t        time;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+    int            backends[] = {BT_IO_SYNC, BT_IO_URING};
+
+    flag = bench_flag(101);
+
+    bt = bench_create(flag);
+    bench_fill(bt, keys);
+    bt_close(bt);
+
+    printf("scan: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s\n", "io", "seconds");
+    for (j = 0; j < sizeof(backends) / sizeof(backends[0]); j++)
+    {
+        flag.io = backends[j];
+        bt = bt_open(flag);
+        time = clock();
+        values = bt_search_range(bt, keys, 0, keys);
+        printf("%8s %10f (found %lu)\n", bt_get_io_backend(bt),
+               (float)(clock() - time) / CLOCKS_PER_SEC, bt_values_get_count(values));
+        bt_values_destory(values);
+        bt_close(bt);
+    }
+    bench_remove();
+}
+
+// inserts made durable one by one, by flush or by wal. bt_flush doesn't
+// sync the file, blocks written count the cost of it.
+static void bench_commit(uint64_t inserts)
+{
+    uint64_t       i, n;
+    int            j;
+    struct timespec start, end;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeFlushStat stat;
+    uint64_t       groups[] = {0, 1, 16};   // 0 for no wal
+
+    flag = bench_flag(101);
+
+    printf("commit: %lu inserts, each committed\n", inserts);
+    printf("%8s %10s %12s\n", "group", "seconds", "blocks");
+    for (j = 0; j < sizeof(groups) / sizeof(groups[0]); j++)
+    {
+        bench_remove();
+        flag.wal = groups[j] != 0;
+        flag.wal_group = groups[j];
+        bt = bt_open(flag);
+
+        srand(0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < inserts; i++)
+        {
+            n = rand();
+            bt_insert(bt, n, n);
+            // with a group, inserts are durable when the group is full
+            if (!flag.wal)
+                bt_commit(bt);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        bt_get_flush_stat(bt, &stat);
+        printf("%8lu %10f %12lu\n", groups[j],
+               bench_seconds(&start, &end),
+               stat.total_blocks);
+        bt_close(bt);
+    }
+    bench_remove();
+}
+
+static int bench_next_pair(void *arg, uint64_t *key, uint64_t *value)
+{
+    uint64_t *pairs = (uint64_t *)arg;    // next index, count, keys...
+
+    if (pairs[0] == pairs[1])
+        return 0;
+    *key = pairs[2 + pairs[0]];
+    *value = *key;
+    pairs[0]++;
+    return 1;
+}
+
+// build a tree of random keys by bt_insert, then by bt_bulk_load of them sorted
+static void bench_build(uint64_t keys)
+{
+    uint64_t       i, *pairs;
+    int            j;
+    struct timespec start, end;
+    struct stat    st;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    const char    *names[] = {"insert", "bulk"};
+
+    flag = bench_flag(101);
+
+    pairs = (uint64_t *)malloc(sizeof(uint64_t) * (keys + 2));
+    pairs[0] = 0;
+    pairs[1] = keys;
+    srand(0);
+    for (i = 0; i < keys; i++)
+        pairs[2 + i] = rand();
+
+    printf("build: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s %12s\n", "method", "seconds", "file bytes");
+    for (j = 0; j < 2; j++)
+    {
+        bench_remove();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bt = bt_open(flag);
+        if (j == 0)
+        {
+            for (i = 0; i < keys; i++)
+                bt_insert(bt, pairs[2 + i], pairs[2 + i]);
+        }
+        else
+        {
+            // sorting is part of the cost
+            qsort(pairs + 2, keys, sizeof(uint64_t), compare_key);
+            bt_bulk_load(bt, bench_next_pair, pairs, 0);
+        }
+        bt_close(bt);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat(flag.file, &st);
+        printf("%8s %10f %12lu\n", names[j],
+               bench_seconds(&start, &end),
+               (uint64_t)st.st_size);
+    }
+    free(pairs);
+    bench_remove();
+}
+
+// inserts of increasing keys, like rowid or time columns, against random ones
+static void bench_append(uint64_t keys)
+{
+    uint64_t       i, n;
+    int            j;
+    struct timespec start, end;
+    struct stat    st;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    const char    *names[] = {"random", "append"};
+
+    flag = bench_flag(101);
+
+    printf("append: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s %12s\n", "keys", "seconds", "file bytes");
+    for (j = 0; j < 2; j++)
+    {
+        bench_remove();
+        srand(0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bt = bt_open(flag);
+        for (i = 0; i < keys; i++)
+        {
+            n = j == 0 ? (uint64_t)rand() : i;
+            bt_insert(bt, n, n);
+        }
+        bt_close(bt);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat(flag.file, &st);
+        printf("%8s %10f %12lu\n", names[j],
+               bench_seconds(&start, &end),
+               (uint64_t)st.st_size);
+    }
+    bench_remove();
+}
+
+// random keys inserted one by one, and in batches. a batch gains when many
+// of its keys go to the same leaf.
+static void bench_batch(uint64_t keys)
+{
+    uint64_t       i, n, *pairs;
+    int            j;
+    struct timespec start, end;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    uint64_t       batches[] = {1, 1000, 100000};  // 1 for bt_insert
+
+    flag = bench_flag(101);
+
+    pairs = (uint64_t *)malloc(sizeof(uint64_t) * keys);
+    srand(0);
+    for (i = 0; i < keys; i++)
+        pairs[i] = rand();
+
+    printf("batch: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s\n", "batch", "seconds");
+    for (j = 0; j < sizeof(batches) / sizeof(batches[0]); j++)
+    {
+        bt = bench_create(flag);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < keys; i += n)
+        {
+            n = keys - i < batches[j] ? keys - i : batches[j];
+            if (batches[j] == 1)
+                bt_insert(bt, pairs[i], pairs[i]);
+            else
+                bt_insert_batch(bt, pairs + i, pairs + i, n);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%8lu %10f\n", batches[j],
+               bench_seconds(&start, &end));
+        bt_close(bt);
+    }
+    free(pairs);
+    bench_remove();
+}
+
+// delete half of random keys and insert as many new ones, blocks of merged
+// nodes are used again so the file should grow little in the second round.
+static void bench_delete(uint64_t keys)
+{
+    uint64_t       i, *pairs;
+    int            j;
+    struct timespec start, end;
+    struct stat    st;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    const char    *names[] = {"insert", "delete", "insert"};
+
+    flag = bench_flag(101);
+
+    pairs = (uint64_t *)malloc(sizeof(uint64_t) * keys * 3 / 2);
+    srand(0);
+    for (i = 0; i < keys * 3 / 2; i++)
+        pairs[i] = rand();
+
+    printf("delete: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s %12s\n", "step", "seconds", "file bytes");
+    bt = bench_create(flag);
+    for (j = 0; j < 3; j++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < (j == 0 ? keys : keys / 2); i++)
+        {
+            if (j == 0)
+                bt_insert(bt, pairs[i], pairs[i]);
+            else if (j == 1)
+                bt_delete(bt, pairs[i * 2]);
+            else
+                bt_insert(bt, pairs[keys + i], pairs[keys + i]);
+        }
+        bt_flush(bt);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat(flag.file, &st);
+        printf("%8s %10f %12lu\n", names[j],
+               bench_seconds(&start, &end),
+               (uint64_t)st.st_size);
+    }
+    bt_close(bt);
+    free(pairs);
+    bench_remove();
+}
+
+// full range scan after random inserts, then after bt_compact laid out
+// leaves in key order. io_uring merges reads of adjacent leaves.
+static void bench_compact(uint64_t keys)
+{
+    int            j;
+    struct timespec start, end;
+    struct stat    st;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+    const char    *names[] = {"random", "compact"};
+
+    flag = bench_flag(101);
+
+    bt = bench_create(flag);
+    bench_fill(bt, keys);
+    bt_close(bt);
+
+    printf("compact: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s %10s %12s\n", "leaves", "compact", "scan", "file bytes");
+    for (j = 0; j < 2; j++)
+    {
+        bt = bt_open(flag);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (j == 1)
+            bt_compact(bt, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%8s %10f", names[j],
+               bench_seconds(&start, &end));
+        bt_close(bt);
+
+        bt = bt_open(flag);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        values = bt_search_range(bt, keys, 0, keys);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat(flag.file, &st);
+        printf(" %10f %12lu\n",
+               bench_seconds(&start, &end),
+               (uint64_t)st.st_size);
+        bt_values_destory(values);
+        bt_close(bt);
+    }
+    bench_remove();
+}
+
+// full range scan of a tree in memory, values copied into BTreeValues or
+// a buffer of caller, against summed by a cursor
+static void bench_cursor(uint64_t keys)
+{
+    uint64_t       i, n, sum, *buffer;
+    int            j;
+    struct timespec start, end;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+    BTreeCursor   *cursor;
+    const char    *names[] = {"values", "buffer", "cursor"};
+
+    flag = bench_flag(101);
+
+    bt = bench_create(flag);
+    bench_fill(bt, keys);
+
+    buffer = (uint64_t *)malloc(sizeof(uint64_t) * keys);
+    printf("cursor: %lu keys, order %lu\n", keys, flag.order);
+    printf("%8s %10s\n", "scan", "seconds");
+    for (j = 0; j < 3; j++)
+    {
+        sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (j == 0)
+        {
+            values = bt_search_range(bt, keys, 0, keys);
+            for (i = 0; i < bt_values_get_count(values); i++)
+                sum += bt_values_get_value(values, i);
+            bt_values_destory(values);
+        }
+        else if (j == 1)
+        {
+            n = bt_search_range_into(bt, 0, keys, buffer, keys);
+            for (i = 0; i < n; i++)
+                sum += buffer[i];
+        }
+        else
+        {
+            cursor = bt_cursor_new(bt);
+            for (n = bt_cursor_seek(cursor, 0); n; n = bt_cursor_next(cursor))
+                sum += bt_cursor_value(cursor);
+            bt_cursor_close(cursor);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%8s %10f (sum %lu)\n", names[j],
+               bench_seconds(&start, &end), sum);
+    }
+    free(buffer);
+    bt_close(bt);
+    bench_remove();
+}
+
+// point lookups one by one against bt_search_batch, probes spread over
+// all keys or close to each other
+static void bench_search_batch(uint64_t keys, uint64_t probes)
+{
+    uint64_t       i, *probe_keys, *counts;
+    int            j, k;
+    struct timespec start, end;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+    const char    *names[] = {"random", "local"};
+
+    flag = bench_flag(101);
+
+    bt = bench_create(flag);
+    bench_fill(bt, keys);
+
+    probe_keys = (uint64_t *)malloc(sizeof(uint64_t) * probes);
+    counts = (uint64_t *)malloc(sizeof(uint64_t) * probes);
+    printf("search batch: %lu keys, %lu probes, order %lu\n", keys, probes, flag.order);
+    printf("%8s %10s %10s\n", "probes", "search", "batch");
+    for (j = 0; j < 2; j++)
+    {
+        // local probes fall in a tenth of keys
+        for (i = 0; i < probes; i++)
+            probe_keys[i] = j == 0 ? rand() % keys : rand() % (keys / 10);
+        printf("%8s", names[j]);
+        for (k = 0; k < 2; k++)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (k == 0)
+            {
+                for (i = 0; i < probes; i++)
+                    bt_values_destory(bt_search(bt, keys, probe_keys[i]));
+            }
+            else
+            {
+                values = bt_search_batch(bt, probe_keys, probes, keys, counts);
+                bt_values_destory(values);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            printf(" %10f", bench_seconds(&start, &end));
+        }
+        printf("\n");
+    }
+    free(counts);
+    free(probe_keys);
+    bt_close(bt);
+    bench_remove();
+}
+
+// latest 10 values of keys not greater than a random key: whole range
+// fetched and its tail kept, against a descending search
+static void bench_desc(uint64_t keys, uint64_t queries)
+{
+    uint64_t       i, n, found;
+    int            j;
+    struct timespec start, end;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    BTreeValues   *values;
+    const char    *names[] = {"range", "desc"};
+
+    flag = bench_flag(101);
+
+    bt = bench_create(flag);
+    for (i = 0; i < keys; i++)
+        bt_insert(bt, i, i);
+
+    printf("desc: %lu keys, %lu queries, order %lu\n", keys, queries, flag.order);
+    printf("%8s %10s\n", "search", "seconds");
+    for (j = 0; j < 2; j++)
+    {
+        srand(0);
+        found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < queries; i++)
+        {
+            n = rand() % keys;
+            if (j == 0)
+                values = bt_search_range(bt, keys, 0, n);
+            else
+                values = bt_search_range_desc(bt, 10, 0, n);
+            found += bt_values_get_count(values) < 10 ? bt_values_get_count(values) : 10;
+            bt_values_destory(values);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%8s %10f (found %lu)\n", names[j],
+               bench_seconds(&start, &end), found);
+    }
+    bt_close(bt);
+    bench_remove();
+}
+
+// insert keys in random order to a plain and a counted tree, then count
+// pairs of random ranges and select pairs at random ranks on both.
+static void bench_count(uint64_t keys, uint64_t queries)
+{
+    uint64_t       i, lo, hi, key, value, found;
+    int            j;
+    struct timespec start, end;
+    double         insert_time, count_time, select_time;
+    BTree         *bt;
+    BTreeOpenFlag  flag;
+    const char    *names[] = {"plain", "counted"};
+
+    flag = bench_flag(101);
+
+    printf("count: %lu keys, %lu queries, order %lu\n", keys, queries, flag.order);
+    printf("%8s %10s %10s %10s\n", "tree", "insert", "count", "select");
+    for (j = 0; j < 2; j++)
+    {
+        flag.counted = j;
+        bt = bench_create(flag);
+
+        srand(0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < keys; i++)
+            bt_insert(bt, rand() % keys, i);
+        bt_flush(bt);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        insert_time = bench_seconds(&start, &end);
+
+        found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < queries; i++)
+        {
+            lo = rand() % keys;
+            hi = rand() % keys;
+            found += bt_count_range(bt, lo < hi ? lo : hi, lo < hi ? hi : lo);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        count_time = bench_seconds(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < queries; i++)
+            found += bt_select(bt, rand() % keys, &key, &value);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        select_time = bench_seconds(&start, &end);
+
+        printf("%8s %10f %10f %10f (found %lu)\n", names[j], insert_time, count_time, select_time, found);
+        bt_close(bt);
+    }
+    bench_remove();
+}
+
+//  compare node search kernels and I/O backends.
+//  args:    keys lookups
+//  example  ./btree_bench 200000 1000000
+int main(int argc, char* argv [])
+{
+    uint64_t       keys = 200000;
+    uint64_t       lookups = 1000000;
+
+    if (argc > 2)
+    {
+        keys = atoi(argv[1]);
+        lookups = atoi(argv[2]);
+    }
+
+    bench_kernel(lookups * 10);
+    bench_tree(keys, lookups);
+    bench_scan(keys);
+    bench_commit(keys / 100);
+    bench_build(keys * 10);
+    bench_append(keys * 10);
+    bench_batch(keys * 10);
+    bench_delete(keys * 10);
+    bench_compact(keys * 10);
+    bench_cursor(keys * 10);
+    bench_search_batch(keys * 10, lookups);
+    bench_desc(keys, lookups / 1000);
+    bench_count(keys * 10, lookups / 1000);
+
+    return 0;
+}
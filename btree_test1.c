@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "btree.h"
 
@@ -30,6 +31,7 @@ int main()
     BTree         *bt;
     BTreeOpenFlag  flag;
 
+    memset(&flag, 0, sizeof(flag));
     flag.create_if_missing = 1;
     flag.error_if_exist = 0;
     flag.file = "./test.bt";
@@ -0,0 +1,434 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// recovery: what is checkpointed or committed is found after reopen, also
+// when the process dies without bt_close. files of the legacy layout are
+// converted by bt_open.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "btree.h"
+
+#define TEST_FILE "./test3.bt"
+#define TEST_WAL  "./test3.bt.wal"
+
+static BTreeOpenFlag test_flag(uint64_t order, int wal, int shadow, uint64_t cache_size)
+{
+    BTreeOpenFlag flag;
+
+    memset(&flag, 0, sizeof(flag));
+    flag.file = TEST_FILE;
+    flag.order = order;
+    flag.create_if_missing = 1;
+    flag.wal = wal;
+    flag.shadow = shadow;
+    flag.cache_size = cache_size;
+    return flag;
+}
+
+static BTree *test_create(BTreeOpenFlag flag)
+{
+    unlink(TEST_FILE);
+    unlink(TEST_WAL);
+    return bt_open(flag);
+}
+
+static uint64_t test_count(BTree *bt)
+{
+    BTreeValues *values;
+    uint64_t     n;
+
+    values = bt_search_range(bt, UINT64_MAX, 0, UINT64_MAX);
+    n = bt_values_get_count(values);
+    bt_values_destory(values);
+    return n;
+}
+
+// nodes written aside by bt_write_back are in the next checkpoint
+static void test_shadow_write_back()
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+
+    flag = test_flag(11, 0, 1, 0);
+    bt = test_create(flag);
+    bt_insert(bt, 1, 1);
+    bt_close(bt);
+
+    bt = bt_open(flag);
+    bt_insert(bt, 2, 2);
+    assert(bt_write_back(bt, 100) > 0);
+    bt_close(bt);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 2);
+    bt_close(bt);
+    printf("shadow write back ok\n");
+}
+
+// checkpoints of a tree not growing reuse blocks, the file stays the same
+static void test_shadow_size()
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    struct stat    st;
+    off_t          size;
+    uint64_t       i;
+
+    flag = test_flag(11, 0, 1, 0);
+    bt = test_create(flag);
+    for (i = 0; i < 1000; i++)
+        bt_insert(bt, i, i);
+    bt_flush(bt);
+
+    size = 0;
+    for (i = 0; i < 2000; i++)
+    {
+        bt_insert(bt, i, i);
+        bt_flush(bt);
+        assert(bt_delete_value(bt, i, i) == 1);
+        bt_flush(bt);
+        if (i == 999)
+        {
+            stat(TEST_FILE, &st);
+            size = st.st_size;
+        }
+    }
+    stat(TEST_FILE, &st);
+    assert(st.st_size == size);
+    assert(test_count(bt) == 1000);
+    bt_close(bt);
+    printf("shadow size ok\n");
+}
+
+// the process dies after a checkpoint and more inserts, a shadow tree is
+// found as checkpointed, with evictions in between too.
+static void test_shadow_crash(uint64_t cache_size)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    uint64_t       i;
+
+    flag = test_flag(11, 0, 1, cache_size);
+    bt = test_create(flag);
+    bt_close(bt);
+    if (fork() == 0)
+    {
+        bt = bt_open(flag);
+        for (i = 0; i < 20000; i++)
+            bt_insert(bt, i * 7919 % 20000, i);
+        bt_flush(bt);
+        for (i = 0; i < 20000; i++)
+            bt_insert(bt, i, i);
+        _exit(0);
+    }
+    wait(NULL);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 20000);
+    bt_close(bt);
+    printf("shadow crash (cache %lu) ok\n", cache_size);
+}
+
+// committed inserts are replayed from the log, those after are lost
+static void test_wal_crash(int shadow, uint64_t cache_size)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    uint64_t       i;
+
+    flag = test_flag(7, 1, shadow, cache_size);
+    bt = test_create(flag);
+    bt_close(bt);
+    if (fork() == 0)
+    {
+        bt = bt_open(flag);
+        for (i = 0; i < 20000; i++)
+            bt_insert(bt, i * 7919 % 20000, i);
+        bt_commit(bt);
+        _exit(0);
+    }
+    wait(NULL);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 20000);
+    bt_close(bt);
+    printf("wal crash (shadow %d, cache %lu) ok\n", shadow, cache_size);
+}
+
+// a batch larger than the cache is replayed whole, whatever was
+// checkpointed while it was merged
+static void test_wal_batch_crash(int shadow)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    BTreeValues   *values;
+    uint64_t      *keys, *vals;
+    uint64_t       i;
+
+    flag = test_flag(7, 1, shadow, 4096);
+    bt = test_create(flag);
+    bt_close(bt);
+    if (fork() == 0)
+    {
+        keys = (uint64_t *)malloc(sizeof(uint64_t) * 20000);
+        vals = (uint64_t *)malloc(sizeof(uint64_t) * 20000);
+        for (i = 0; i < 20000; i++)
+        {
+            keys[i] = i * 7919 % 10000;
+            vals[i] = i;
+        }
+        bt = bt_open(flag);
+        bt_insert_batch(bt, keys, vals, 20000);
+        bt_commit(bt);
+        _exit(0);
+    }
+    wait(NULL);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 20000);
+    for (i = 0; i < 10000; i += 997)
+    {
+        values = bt_search(bt, UINT64_MAX, i);
+        assert(bt_values_get_count(values) == 2);
+        bt_values_destory(values);
+    }
+    bt_close(bt);
+    printf("wal batch crash (shadow %d) ok\n", shadow);
+}
+
+// nodes are evicted from a small cache. modified ones are written aside
+// in shadow mode, otherwise kept until the tree checkpoints by itself.
+static void test_cache(int shadow)
+{
+    BTreeOpenFlag   flag;
+    BTree          *bt;
+    BTreeCacheStat  cache;
+    BTreeFlushStat  flush;
+    BTreeValues    *values;
+    uint64_t        i;
+
+    flag = test_flag(7, 0, shadow, 4096);
+    bt = test_create(flag);
+    for (i = 0; i < 20000; i++)
+        bt_insert(bt, i * 7919 % 20000, i);
+    bt_get_cache_stat(bt, &cache);
+    bt_get_flush_stat(bt, &flush);
+    assert(cache.capacity == 4096 && cache.used <= cache.capacity);
+    assert(cache.hits > 0 && cache.misses > 0 && cache.evictions > 0);
+    if (shadow)
+        assert(cache.write_backs > 0 && flush.generation == 0);
+    else
+        assert(cache.write_backs == 0 && flush.generation > 0);
+    bt_close(bt);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 20000);
+    for (i = 0; i < 20000; i += 97)
+    {
+        values = bt_search(bt, 10, i * 7919 % 20000);
+        assert(bt_values_get_count(values) == 1 && bt_values_get_value(values, 0) == i);
+        bt_values_destory(values);
+    }
+    bt_close(bt);
+    printf("cache (shadow %d) ok\n", shadow);
+}
+
+// the process dies while a tree without shadow or log checkpoints by
+// itself to stay in a small cache. it is found as of one of them: the
+// keys inserted up to some insert, and none after.
+static void test_cache_crash()
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    BTreeValues   *values;
+    uint64_t       i, n;
+
+    flag = test_flag(7, 0, 0, 4096);
+    bt = test_create(flag);
+    bt_close(bt);
+    if (fork() == 0)
+    {
+        bt = bt_open(flag);
+        for (i = 0; i < 10000; i++)
+            bt_insert(bt, i * 7919 % 20000, i);
+        bt_flush(bt);
+        for (; i < 20000; i++)
+            bt_insert(bt, i * 7919 % 20000, i);
+        _exit(0);
+    }
+    wait(NULL);
+
+    bt = bt_open(flag);
+    n = test_count(bt);
+    assert(n >= 10000 && n < 20000);
+    for (i = 0; i < 20000; i++)
+    {
+        values = bt_search(bt, 10, i * 7919 % 20000);
+        assert(bt_values_get_count(values) == (i < n));
+        bt_values_destory(values);
+    }
+    bt_close(bt);
+    printf("cache crash (%lu of 20000) ok\n", n);
+}
+
+// version 0 file of order 5: meta blk, then blocks of type, key_counts,
+// parent, left and right sibling, followed by [V0 K0 V1 K1 ...] in leaves
+// or [CN0 K0 CN1 K1 ... CNm] in the root
+#define TEST_LEGACY_ORDER   5
+#define TEST_LEGACY_BLKSIZE (5 * 8 + (TEST_LEGACY_ORDER * 2 - 1) * 8)
+
+// key j of leaf i, the first keys of leaf 1 and 2 are the separators
+static uint64_t test_legacy_key(uint64_t i, uint64_t j)
+{
+    return i ? i * 10 + j : j + 1;
+}
+
+static void test_write_legacy_blk(int fd, uint64_t blkid, uint64_t type, uint64_t key_counts,
+                                  uint64_t left, uint64_t right, uint64_t *pairs, uint64_t n)
+{
+    uint64_t blk[TEST_LEGACY_BLKSIZE / 8];
+    ssize_t  rtv;
+
+    memset(blk, 0, sizeof(blk));
+    blk[0] = type;
+    blk[1] = key_counts;
+    blk[3] = left;
+    blk[4] = right;
+    memcpy(&blk[5], pairs, n * sizeof(uint64_t));
+    rtv = pwrite(fd, blk, sizeof(blk), blkid * sizeof(blk));
+    assert(rtv == sizeof(blk));
+}
+
+// root 1 over leaves 2, 3, 4 holding keys 1..4, 10..13, 20..23
+static void test_write_legacy()
+{
+    uint64_t meta[TEST_LEGACY_BLKSIZE / 8];
+    uint64_t pairs[TEST_LEGACY_ORDER * 2 - 1];
+    uint64_t i, j;
+    ssize_t  rtv;
+    int      fd;
+
+    unlink(TEST_FILE);
+    unlink(TEST_WAL);
+    fd = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(fd != -1);
+
+    memset(meta, 0, sizeof(meta));
+    meta[0] = 0xbbbbbbbb;
+    meta[1] = TEST_LEGACY_ORDER;
+    meta[2] = TEST_LEGACY_BLKSIZE;
+    meta[3] = 1;
+    meta[4] = 4;
+    meta[5] = 4;
+    rtv = pwrite(fd, meta, sizeof(meta), 0);
+    assert(rtv == sizeof(meta));
+
+    pairs[0] = 2;
+    pairs[1] = 10;
+    pairs[2] = 3;
+    pairs[3] = 20;
+    pairs[4] = 4;
+    test_write_legacy_blk(fd, 1, 1, 2, 0, 0, pairs, 5);
+    for (i = 0; i < 3; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            pairs[j * 2] = test_legacy_key(i, j) * 100;
+            pairs[j * 2 + 1] = test_legacy_key(i, j);
+        }
+        test_write_legacy_blk(fd, i + 2, 4, 4, i ? i + 1 : 0, i < 2 ? i + 3 : 0, pairs, 8);
+    }
+    close(fd);
+}
+
+static void test_check_legacy(BTree *bt)
+{
+    BTreeValues *values;
+    uint64_t     i, j, key;
+
+    assert(test_count(bt) == 12);
+    for (i = 0; i < 3; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            key = test_legacy_key(i, j);
+            values = bt_search(bt, 10, key);
+            assert(bt_values_get_count(values) == 1 && bt_values_get_value(values, 0) == key * 100);
+            bt_values_destory(values);
+        }
+    }
+}
+
+// a version 0 file is rewritten by bt_open, every key is found and the
+// tree takes inserts as any other
+static void test_legacy_upgrade()
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    uint64_t       i;
+
+    test_write_legacy();
+    flag = test_flag(TEST_LEGACY_ORDER, 0, 0, 0);
+    flag.create_if_missing = 0;
+    bt = bt_open(flag);
+    test_check_legacy(bt);
+    assert(access(TEST_FILE ".upgrade", F_OK) != 0);
+    for (i = 100; i < 1100; i++)
+        bt_insert(bt, i, i * 100);
+    bt_close(bt);
+
+    bt = bt_open(flag);
+    assert(test_count(bt) == 1012);
+    for (i = 100; i < 1100; i++)
+        assert(bt_delete_value(bt, i, i * 100) == 1);
+    test_check_legacy(bt);
+    bt_close(bt);
+    printf("legacy upgrade ok\n");
+}
+
+int main()
+{
+    test_shadow_write_back();
+    test_shadow_size();
+    test_shadow_crash(0);
+    test_shadow_crash(4096);
+    test_wal_crash(0, 0);
+    test_wal_crash(0, 4096);
+    test_wal_crash(1, 4096);
+    test_wal_batch_crash(0);
+    test_wal_batch_crash(1);
+    test_cache(0);
+    test_cache(1);
+    test_cache_crash();
+    test_legacy_upgrade();
+
+    unlink(TEST_FILE);
+    unlink(TEST_WAL);
+    printf("btree_test3 ok\n");
+    return 0;
+}
@@ -0,0 +1,333 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// inserts and deletes checked against a sorted array of pairs. keys are few,
+// so values of a key span leaves, and equal pairs are inserted too. counts
+// and ranks of counted trees are checked the same way.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "btree.h"
+#include "btree_test_model.h"
+
+#define TEST_FILE "./test4.bt"
+#define TEST_WAL  "./test4.bt.wal"
+
+static uint64_t test_seed;
+
+static uint64_t test_rand()
+{
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 7;
+    test_seed ^= test_seed << 17;
+    return test_seed;
+}
+
+/////////////////////////////////////////////////
+//  Check
+/////////////////////////////////////////////////
+
+// all pairs of bt in key order, values of a key sorted to compare
+static void test_check(BTree *bt, TestModel *model)
+{
+    BTreeCursor *cursor;
+    TestPair    *pairs;
+    uint64_t     n, start, i;
+    int          more;
+
+    pairs = (TestPair *)malloc(sizeof(TestPair) * (model->counts + 1));
+    cursor = bt_cursor_new(bt);
+    n = 0;
+    for (more = bt_cursor_seek(cursor, 0); more; more = bt_cursor_next(cursor))
+    {
+        assert(n < model->counts);
+        pairs[n].key = bt_cursor_key(cursor);
+        pairs[n].value = bt_cursor_value(cursor);
+        assert(n == 0 || pairs[n - 1].key <= pairs[n].key);
+        n++;
+    }
+    bt_cursor_close(cursor);
+    assert(n == model->counts);
+
+    for (start = 0; start < n; start = i)
+    {
+        for (i = start; i < n && pairs[i].key == pairs[start].key; i++)
+            ;
+        qsort(pairs + start, i - start, sizeof(TestPair), test_compare_pair);
+    }
+    assert(memcmp(pairs, model->pairs, sizeof(TestPair) * n) == 0);
+    free(pairs);
+}
+
+// counts of ranges, and pairs at all ranks by bt_select and a cursor,
+// against the model. a pair of a key at a rank may be any of its values.
+static void test_check_counts(BTree *bt, TestModel *model, uint64_t keys)
+{
+    BTreeCursor *cursor;
+    TestModel   *selected;
+    uint64_t     i, lo, hi, counts, rank, key, value;
+
+    for (i = 0; i < 200; i++)
+    {
+        lo = test_rand() % (keys + 2);
+        hi = lo + test_rand() % (keys / 4 + 1);
+        counts = test_model_upper_bound(model, hi) - test_model_lower_bound(model, lo, 0);
+        assert(bt_count_range(bt, lo, hi) == counts);
+    }
+    assert(bt_count_range(bt, 0, UINT64_MAX) == model->counts);
+    assert(bt_count_range(bt, keys, UINT64_MAX) == 0);
+
+    selected = test_model_new(model->counts + 1);
+    cursor = bt_cursor_new(bt);
+    for (rank = 0; rank < model->counts; rank++)
+    {
+        assert(bt_select(bt, rank, &key, &value) == 1);
+        assert(key == model->pairs[rank].key);
+        test_model_insert(selected, key, value);
+
+        assert(bt_cursor_seek_rank(cursor, rank) == 1);
+        assert(bt_cursor_key(cursor) == key);
+        assert(bt_cursor_value(cursor) == value);
+    }
+    assert(bt_select(bt, model->counts, &key, &value) == 0);
+    assert(bt_cursor_seek_rank(cursor, model->counts) == 0);
+    bt_cursor_close(cursor);
+
+    assert(selected->counts == model->counts);
+    assert(memcmp(selected->pairs, model->pairs, sizeof(TestPair) * model->counts) == 0);
+    test_model_destory(selected);
+}
+
+// n random operations on bt and model, either may be NULL. keys are in
+// [0, keys) and values in [0, 4), deletes pick them alike and may miss.
+static void test_run(BTree *bt, TestModel *model, uint64_t seed, uint64_t n, uint64_t keys)
+{
+    uint64_t i, op, key, value, deleted;
+
+    test_seed = seed;
+    for (i = 0; i < n; i++)
+    {
+        op = test_rand() % 20;
+        key = test_rand() % keys;
+        value = test_rand() % 4;
+        if (op < 12)
+        {
+            if (bt)
+                bt_insert(bt, key, value);
+            if (model)
+                test_model_insert(model, key, value);
+        }
+        else if (op < 18)
+        {
+            deleted = bt ? bt_delete_value(bt, key, value) : 0;
+            if (model)
+                assert(test_model_delete_value(model, key, value) == deleted || !bt);
+        }
+        else
+        {
+            deleted = bt ? bt_delete(bt, key) : 0;
+            if (model)
+                assert(test_model_delete(model, key) == deleted || !bt);
+        }
+    }
+}
+
+/////////////////////////////////////////////////
+//  Tests
+/////////////////////////////////////////////////
+
+static BTreeOpenFlag test_flag(int wal, int shadow, uint64_t cache_size)
+{
+    BTreeOpenFlag flag;
+
+    memset(&flag, 0, sizeof(flag));
+    flag.file = TEST_FILE;
+    flag.order = 5;
+    flag.create_if_missing = 1;
+    flag.wal = wal;
+    flag.shadow = shadow;
+    flag.cache_size = cache_size;
+    return flag;
+}
+
+static BTree *test_create(BTreeOpenFlag flag)
+{
+    unlink(TEST_FILE);
+    unlink(TEST_WAL);
+    return bt_open(flag);
+}
+
+static off_t test_file_size()
+{
+    struct stat st;
+
+    stat(TEST_FILE, &st);
+    return st.st_size;
+}
+
+// nodes borrow and merge as keys go, deleting all collapses the root
+static void test_delete(uint64_t cache_size)
+{
+    BTree       *bt;
+    TestModel   *model;
+    uint64_t     round, key;
+
+    bt = test_create(test_flag(0, 0, cache_size));
+    model = test_model_new(100000);
+    for (round = 0; round < 10; round++)
+    {
+        test_run(bt, model, round + 1, 5000, 300);
+        test_check(bt, model);
+    }
+
+    for (key = 0; key < 300; key++)
+        assert(bt_delete(bt, key) == test_model_delete(model, key));
+    assert(model->counts == 0);
+    test_check(bt, model);
+
+    test_run(bt, model, 99, 5000, 300);
+    test_check(bt, model);
+    bt_close(bt);
+    test_model_destory(model);
+    printf("delete (cache %lu) ok\n", cache_size);
+}
+
+// blocks of merged nodes are kept in the file and used after reopen
+static void test_free_reuse(int shadow)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    uint64_t       i;
+    off_t          size;
+
+    flag = test_flag(0, shadow, 0);
+    bt = test_create(flag);
+    for (i = 0; i < 20000; i++)
+        bt_insert(bt, i, i);
+    bt_flush(bt);
+    for (i = 0; i < 20000; i++)
+        assert(bt_delete(bt, i) == 1);
+    bt_close(bt);
+    size = test_file_size();
+
+    bt = bt_open(flag);
+    for (i = 0; i < 20000; i++)
+        bt_insert(bt, i, i);
+    bt_close(bt);
+    assert(test_file_size() <= size);
+    printf("free list reuse (shadow %d) ok\n", shadow);
+}
+
+// counts kept in nodes follow inserts, batches, deletes, borrows and merges,
+// a reopen and a compact. plain trees count by walking leaves.
+static void test_counted(int counted, uint64_t cache_size)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    TestModel     *model;
+    uint64_t       keys[2000], values[2000];
+    uint64_t       round, i;
+
+    flag = test_flag(0, 0, cache_size);
+    flag.counted = counted;
+    bt = test_create(flag);
+    model = test_model_new(100000);
+    for (round = 0; round < 6; round++)
+    {
+        test_run(bt, model, round + 1, 4000, 300);
+        for (i = 0; i < 2000; i++)
+        {
+            keys[i] = test_rand() % 300;
+            values[i] = test_rand() % 4;
+            test_model_insert(model, keys[i], values[i]);
+        }
+        bt_insert_batch(bt, keys, values, 2000);
+        test_check_counts(bt, model, 300);
+    }
+    bt_close(bt);
+
+    bt = bt_open(flag);
+    test_check_counts(bt, model, 300);
+    bt_compact(bt, 70);
+    test_check_counts(bt, model, 300);
+    test_run(bt, model, 99, 4000, 300);
+    test_check_counts(bt, model, 300);
+    test_check(bt, model);
+    bt_close(bt);
+    test_model_destory(model);
+    printf("counts (counted %d, cache %lu) ok\n", counted, cache_size);
+}
+
+// deletes after a checkpoint are replayed from the log over it
+static void test_wal_delete(int shadow, uint64_t cache_size)
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    TestModel     *model;
+
+    flag = test_flag(1, shadow, cache_size);
+    flag.wal_group = 1024;
+    bt = test_create(flag);
+    bt_close(bt);
+    if (fork() == 0)
+    {
+        bt = bt_open(flag);
+        test_run(bt, NULL, 1, 20000, 300);
+        bt_flush(bt);
+        test_run(bt, NULL, 2, 20000, 300);
+        bt_commit(bt);
+        _exit(0);
+    }
+    wait(NULL);
+
+    model = test_model_new(100000);
+    test_run(NULL, model, 1, 20000, 300);
+    test_run(NULL, model, 2, 20000, 300);
+    bt = bt_open(flag);
+    test_check(bt, model);
+    bt_close(bt);
+    test_model_destory(model);
+    printf("wal delete (shadow %d, cache %lu) ok\n", shadow, cache_size);
+}
+
+int main()
+{
+    test_delete(0);
+    test_delete(4096);
+    test_free_reuse(0);
+    test_free_reuse(1);
+    test_wal_delete(0, 0);
+    test_wal_delete(0, 4096);
+    test_wal_delete(1, 4096);
+    test_counted(1, 0);
+    test_counted(1, 4096);
+    test_counted(0, 0);
+
+    unlink(TEST_FILE);
+    unlink(TEST_WAL);
+    printf("btree_test4 ok\n");
+    return 0;
+}
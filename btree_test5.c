@@ -0,0 +1,334 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// cursors, descending searches, searches into buffers and batch searches
+// checked against a sorted array of pairs. keys have up to 7 values, so
+// they span leaves, and UINT64_MAX is a key too.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "btree.h"
+#include "btree_test_model.h"
+
+#define TEST_FILE "./test5.bt"
+#define TEST_KEYS 1000
+
+static TestModel *model;        // all pairs of the tree
+
+// values found of key, in any order, are values of pairs from start
+static void test_check_values(uint64_t *values, uint64_t n, uint64_t start)
+{
+    uint64_t i;
+
+    qsort(values, n, sizeof(uint64_t), test_compare_value);
+    for (i = 0; i < n; i++)
+    {
+        assert(model->pairs[start + i].key == model->pairs[start].key);
+        assert(values[i] == model->pairs[start + i].value);
+    }
+}
+
+// keys 1, 4, 7 ... and UINT64_MAX, key k has k % 7 + 1 values. pairs are
+// inserted in random order.
+static BTree *test_create()
+{
+    BTreeOpenFlag  flag;
+    BTree         *bt;
+    uint64_t       i, j, k;
+    TestPair       pair;
+
+    model = test_model_new((TEST_KEYS + 1) * 7);
+    for (i = 0; i <= TEST_KEYS; i++)
+    {
+        k = i < TEST_KEYS ? i * 3 + 1 : UINT64_MAX;
+        for (j = 0; j <= k % 7; j++)
+        {
+            model->pairs[model->counts].key = k;
+            model->pairs[model->counts].value = i * 10 + j;
+            model->counts++;
+        }
+    }
+    srand(0);
+    for (i = model->counts - 1; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        pair = model->pairs[i];
+        model->pairs[i] = model->pairs[j];
+        model->pairs[j] = pair;
+    }
+
+    memset(&flag, 0, sizeof(flag));
+    flag.file = TEST_FILE;
+    flag.order = 5;
+    flag.create_if_missing = 1;
+    unlink(TEST_FILE);
+    bt = bt_open(flag);
+    for (i = 0; i < model->counts; i++)
+        bt_insert(bt, model->pairs[i].key, model->pairs[i].value);
+    test_model_sort(model);
+    return bt;
+}
+
+// pairs from a cursor walk in either way, from pair start on, are the
+// pairs of sorted array, values of a key in any order
+static void test_check_walk(BTreeCursor *cursor, int more, uint64_t start, int backward)
+{
+    uint64_t *values;
+    uint64_t  i, n, key, first;
+
+    values = (uint64_t *)malloc(sizeof(uint64_t) * model->counts);
+    n = 0;
+    first = 0;
+    i = start;
+    while (more)
+    {
+        key = bt_cursor_key(cursor);
+        if (n > 0 && key != model->pairs[first].key)
+        {
+            test_check_values(values, n, first);
+            n = 0;
+        }
+        if (n == 0)
+        {
+            // pairs of key before or after i in sorted array
+            assert(backward ? i > 0 : i < model->counts);
+            first = backward ? test_model_lower_bound(model, key, 0) : i;
+            assert(model->pairs[first].key == key);
+        }
+        values[n++] = bt_cursor_value(cursor);
+        i = backward ? i - 1 : i + 1;
+        more = backward ? bt_cursor_prev(cursor) : bt_cursor_next(cursor);
+    }
+    if (n > 0)
+        test_check_values(values, n, first);
+    assert(i == (backward ? 0 : model->counts));
+    free(values);
+}
+
+static void test_cursor(BTree *bt)
+{
+    BTreeCursor *cursor;
+    uint64_t     key, i;
+    int          more;
+
+    cursor = bt_cursor_new(bt);
+    for (key = 0; key < TEST_KEYS * 3 + 2; key++)
+    {
+        // first pair of key not less than key
+        i = test_model_lower_bound(model, key, 0);
+        more = bt_cursor_seek(cursor, key);
+        assert(more == 1);
+        assert(bt_cursor_key(cursor) == model->pairs[i].key);
+
+        // last pair of key not greater than key
+        i = test_model_upper_bound(model, key);
+        more = bt_cursor_seek_last(cursor, key);
+        assert(more == (i > 0));
+        if (more)
+            assert(bt_cursor_key(cursor) == model->pairs[i - 1].key);
+    }
+
+    // whole walks, and those from pairs of the last keys
+    test_check_walk(cursor, bt_cursor_seek(cursor, 0), 0, 0);
+    test_check_walk(cursor, bt_cursor_seek_last(cursor, UINT64_MAX), model->counts, 1);
+    i = test_model_lower_bound(model, UINT64_MAX, 0);
+    test_check_walk(cursor, bt_cursor_seek(cursor, UINT64_MAX), i, 0);
+    test_check_walk(cursor, bt_cursor_seek(cursor, UINT64_MAX - 1), i, 0);
+    i = test_model_upper_bound(model, TEST_KEYS * 3);
+    test_check_walk(cursor, bt_cursor_seek_last(cursor, UINT64_MAX - 1), i, 1);
+
+    // stepping back and forth over values of a key spanning leaves
+    assert(bt_cursor_seek(cursor, 19) == 1);
+    i = 0;
+    while (bt_cursor_key(cursor) == 19)
+    {
+        assert(bt_cursor_next(cursor) == 1);
+        i++;
+    }
+    assert(i == 19 % 7 + 1);
+    for (; i > 0; i--)
+    {
+        assert(bt_cursor_prev(cursor) == 1);
+        assert(bt_cursor_key(cursor) == 19);
+    }
+    assert(bt_cursor_prev(cursor) == 1);
+    assert(bt_cursor_key(cursor) == 16);
+
+    // before the first and past the last pair
+    assert(bt_cursor_seek_last(cursor, 0) == 0);
+    assert(bt_cursor_seek(cursor, 1) == 1);
+    assert(bt_cursor_prev(cursor) == 0);
+    assert(bt_cursor_seek_last(cursor, UINT64_MAX) == 1);
+    assert(bt_cursor_next(cursor) == 0);
+    bt_cursor_close(cursor);
+    printf("cursor ok\n");
+}
+
+// key of a value, see test_create
+static uint64_t test_value_key(uint64_t value)
+{
+    return value / 10 < TEST_KEYS ? value / 10 * 3 + 1 : UINT64_MAX;
+}
+
+// values of a range from key_max down, cut at limit: keys don't increase,
+// and are the last keys of the range, those of a key in the reverse order
+// of an ascending search.
+static void test_desc(BTree *bt)
+{
+    BTreeValues *values, *asc;
+    uint64_t     ranges[][2] = {{0, UINT64_MAX}, {10, 40}, {19, 19}, {0, 1},
+                                {UINT64_MAX - 1, UINT64_MAX}, {UINT64_MAX, UINT64_MAX},
+                                {2, 3}, {0, 0}, {3000, UINT64_MAX - 1}, {40, 10}};
+    uint64_t     limits[] = {0, 1, 3, 7, 100, UINT64_MAX};
+    uint64_t     r, l, i, n, counts, key, first, last;
+
+    for (r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+    {
+        first = test_model_lower_bound(model, ranges[r][0], 0);
+        last = test_model_upper_bound(model, ranges[r][1]);
+        counts = first < last ? last - first : 0;
+        asc = bt_search_range(bt, UINT64_MAX, ranges[r][0], ranges[r][1]);
+        assert(bt_values_get_count(asc) == counts);
+        for (l = 0; l < sizeof(limits) / sizeof(limits[0]); l++)
+        {
+            values = bt_search_range_desc(bt, limits[l], ranges[r][0], ranges[r][1]);
+            n = bt_values_get_count(values);
+            assert(n == (counts < limits[l] ? counts : limits[l]));
+            for (i = 0; i < n; i++)
+            {
+                key = test_value_key(bt_values_get_value(values, i));
+                assert(key >= ranges[r][0] && key <= ranges[r][1]);
+                assert(key == model->pairs[last - 1 - i].key);
+                assert(bt_values_get_value(values, i) == bt_values_get_value(asc, counts - 1 - i));
+            }
+            bt_values_destory(values);
+        }
+        bt_values_destory(asc);
+    }
+    printf("desc ok\n");
+}
+
+static void test_into(BTree *bt)
+{
+    BTreeValues *values;
+    uint64_t     out[64];
+    uint64_t     keys[] = {0, 1, 19, 20, 3000, UINT64_MAX - 1, UINT64_MAX};
+    uint64_t     cap, start, counts, n, i, k;
+
+    for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++)
+    {
+        start = test_model_lower_bound(model, keys[k], 0);
+        counts = test_model_upper_bound(model, keys[k]) - start;
+        for (cap = 0; cap <= 8; cap++)
+        {
+            // nothing is written past cap
+            for (i = 0; i < 64; i++)
+                out[i] = 12345;
+            n = bt_search_into(bt, keys[k], out, cap);
+            assert(n == (counts < cap ? counts : cap));
+            for (i = n; i < 64; i++)
+                assert(out[i] == 12345);
+            if (n == counts)
+                test_check_values(out, n, start);
+
+            values = bt_search(bt, cap, keys[k]);
+            assert(bt_values_get_count(values) == n);
+            bt_values_destory(values);
+        }
+    }
+
+    // ranges over several keys, cut by cap in key order
+    for (cap = 0; cap < 64; cap += 7)
+    {
+        n = bt_search_range_into(bt, 10, 40, out, cap);
+        counts = test_model_upper_bound(model, 40) - test_model_lower_bound(model, 10, 0);
+        assert(n == (counts < cap ? counts : cap));
+        values = bt_search_range(bt, cap, 10, 40);
+        assert(bt_values_get_count(values) == n);
+        for (i = 0; i < n; i++)
+            assert(bt_values_get_value(values, i) == out[i]);
+        bt_values_destory(values);
+    }
+    n = bt_search_range_into(bt, 0, UINT64_MAX, out, 0);
+    assert(n == 0);
+    n = bt_search_range_into(bt, UINT64_MAX, UINT64_MAX, out, 64);
+    assert(n == UINT64_MAX % 7 + 1);
+    printf("into ok\n");
+}
+
+static void test_search_batch(BTree *bt)
+{
+    BTreeValues *values;
+    uint64_t     probes[] = {19, 0, UINT64_MAX, 19, 4, 3000, 2998, UINT64_MAX, 19, 1};
+    uint64_t     limits[] = {0, 1, 3, UINT64_MAX};
+    uint64_t     counts[sizeof(probes) / sizeof(probes[0])];
+    uint64_t     found[64];
+    uint64_t     n, i, l, c, start, offset;
+
+    n = sizeof(probes) / sizeof(probes[0]);
+    for (l = 0; l < sizeof(limits) / sizeof(limits[0]); l++)
+    {
+        values = bt_search_batch(bt, probes, n, limits[l], counts);
+        offset = 0;
+        for (i = 0; i < n; i++)
+        {
+            start = test_model_lower_bound(model, probes[i], 0);
+            c = test_model_upper_bound(model, probes[i]) - start;
+            assert(counts[i] == (c < limits[l] ? c : limits[l]));
+
+            // values of a probe are those of its key, in the same order as
+            // a bt_search gives them
+            assert(bt_search_into(bt, probes[i], found, counts[i]) == counts[i]);
+            for (c = 0; c < counts[i]; c++)
+                assert(bt_values_get_value(values, offset + c) == found[c]);
+            if (counts[i] == test_model_upper_bound(model, probes[i]) - start)
+                test_check_values(found, counts[i], start);
+            offset += counts[i];
+        }
+        assert(bt_values_get_count(values) == offset);
+        bt_values_destory(values);
+    }
+
+    values = bt_search_batch(bt, probes, 0, UINT64_MAX, counts);
+    assert(bt_values_get_count(values) == 0);
+    bt_values_destory(values);
+    printf("search batch ok\n");
+}
+
+int main()
+{
+    BTree *bt;
+
+    bt = test_create();
+    test_cursor(bt);
+    test_desc(bt);
+    test_into(bt);
+    test_search_batch(bt);
+    bt_close(bt);
+
+    test_model_destory(model);
+    unlink(TEST_FILE);
+    printf("btree_test5 ok\n");
+    return 0;
+}
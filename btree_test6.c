@@ -0,0 +1,214 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// fill of leaves: bt_bulk_load fills them to the percent asked, appends of
+// increasing keys leave them full. leaves are counted by blocks of the
+// file, nodes above are a few more.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+
+#define TEST_FILE  "./test6.bt"
+#define TEST_ORDER 101
+#define TEST_KEYS  100000
+#define TEST_PAIRS (TEST_KEYS + TEST_KEYS / 1000)
+
+static BTreeOpenFlag test_flag()
+{
+    BTreeOpenFlag flag;
+
+    memset(&flag, 0, sizeof(flag));
+    flag.file = TEST_FILE;
+    flag.order = TEST_ORDER;
+    flag.create_if_missing = 1;
+    return flag;
+}
+
+static BTree *test_create()
+{
+    unlink(TEST_FILE);
+    return bt_open(test_flag());
+}
+
+static uint64_t test_blksize;
+
+static uint64_t test_file_size()
+{
+    struct stat st;
+
+    assert(stat(TEST_FILE, &st) == 0);
+    return st.st_size;
+}
+
+// blocks of the file but the meta block
+static uint64_t test_blocks()
+{
+    assert(test_file_size() % test_blksize == 0);
+    return test_file_size() / test_blksize - 1;
+}
+
+// n leaves of fill keys each, with nodes above them of at least half fill
+static void test_check_blocks(uint64_t blocks, uint64_t fill)
+{
+    uint64_t leaves;
+
+    leaves = (TEST_PAIRS + fill - 1) / fill;
+    assert(blocks >= leaves);
+    assert(blocks <= leaves + leaves / (TEST_ORDER / 2) + 2);
+}
+
+// pairs of key i * 2 and value i, some keys have 2 values. with between
+// set, key i * 2 + 1 is there too for i % 100 == 1.
+static void test_check(BTree *bt, uint64_t counts, int between)
+{
+    BTreeCursor *cursor;
+    BTreeValues *values;
+    uint64_t     i, n, key;
+
+    cursor = bt_cursor_new(bt);
+    n = 0;
+    key = 0;
+    if (bt_cursor_seek(cursor, 0))
+    {
+        do
+        {
+            assert(bt_cursor_key(cursor) >= key);
+            key = bt_cursor_key(cursor);
+            n++;
+        } while (bt_cursor_next(cursor));
+    }
+    bt_cursor_close(cursor);
+    assert(n == counts);
+
+    for (i = 0; i < TEST_KEYS; i += 7)
+    {
+        values = bt_search(bt, 10, i * 2);
+        assert(bt_values_get_count(values) == 1 + (i % 1000 == 0));
+        bt_values_destory(values);
+        values = bt_search(bt, 10, i * 2 + 1);
+        assert(bt_values_get_count(values) == (between && i % 100 == 1));
+        bt_values_destory(values);
+    }
+}
+
+// i-th pair of key i * 2, keys of i % 1000 == 0 have a second one
+typedef struct {
+    uint64_t i;
+    int      again;
+} TestPairs;
+
+static int test_next_pair(void *arg, uint64_t *key, uint64_t *value)
+{
+    TestPairs *pairs = (TestPairs *)arg;
+
+    if (pairs->i == TEST_KEYS)
+        return 0;
+    *key = pairs->i * 2;
+    *value = pairs->i;
+    if (pairs->i % 1000 == 0 && !pairs->again)
+    {
+        pairs->again = 1;
+    }
+    else
+    {
+        pairs->again = 0;
+        pairs->i++;
+    }
+    return 1;
+}
+
+// leaves are filled to fill percent of order - 1 keys, at least half
+static void test_bulk_load(uint64_t fill)
+{
+    BTree     *bt;
+    TestPairs  pairs;
+    uint64_t   leaf_fill;
+
+    bt = test_create();
+    memset(&pairs, 0, sizeof(pairs));
+    assert(bt_bulk_load(bt, test_next_pair, &pairs, fill) == 0);
+    bt_close(bt);
+
+    leaf_fill = (fill == 0 ? 100 : fill) * (TEST_ORDER - 1) / 100;
+    if (leaf_fill < TEST_ORDER / 2)
+        leaf_fill = TEST_ORDER / 2;
+    test_check_blocks(test_blocks(), leaf_fill);
+
+    bt = bt_open(test_flag());
+    test_check(bt, TEST_PAIRS, 0);
+    // the tree is not empty any more
+    memset(&pairs, 0, sizeof(pairs));
+    assert(bt_bulk_load(bt, test_next_pair, &pairs, fill) == -1);
+    bt_close(bt);
+    printf("bulk load (fill %lu) ok\n", fill);
+}
+
+// increasing keys fill every leaf but the last, keys inserted after in
+// between go to the right leaves
+static void test_append()
+{
+    BTree     *bt;
+    TestPairs  pairs;
+    uint64_t   i, key, value;
+
+    bt = test_create();
+    memset(&pairs, 0, sizeof(pairs));
+    while (test_next_pair(&pairs, &key, &value))
+        bt_insert(bt, key, value);
+    bt_close(bt);
+    test_check_blocks(test_blocks(), TEST_ORDER - 1);
+
+    bt = bt_open(test_flag());
+    test_check(bt, TEST_PAIRS, 0);
+    for (i = 1; i < TEST_KEYS; i += 100)
+        bt_insert(bt, i * 2 + 1, i);
+    bt_close(bt);
+
+    bt = bt_open(test_flag());
+    test_check(bt, TEST_PAIRS + TEST_KEYS / 100, 1);
+    bt_close(bt);
+    printf("append ok\n");
+}
+
+int main()
+{
+    BTree *bt;
+
+    // a tree of one leaf is 2 blocks
+    bt = test_create();
+    bt_close(bt);
+    test_blksize = test_file_size() / 2;
+    test_bulk_load(0);
+    test_bulk_load(10);
+    test_bulk_load(50);
+    test_bulk_load(70);
+    test_bulk_load(100);
+    test_append();
+
+    unlink(TEST_FILE);
+    printf("btree_test6 ok\n");
+    return 0;
+}
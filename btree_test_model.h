@@ -0,0 +1,151 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// reference model of tests: all pairs of a tree in a sorted array
+
+#ifndef __BTREE_TEST_MODEL_H
+#define __BTREE_TEST_MODEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct TestPair {
+    uint64_t key;
+    uint64_t value;
+} TestPair;
+
+typedef struct TestModel {
+    uint64_t  counts;
+    TestPair *pairs;        // sorted by key, then value
+} TestModel;
+
+static inline int test_compare_pair(const void *a, const void *b)
+{
+    const TestPair *pa = (const TestPair *)a;
+    const TestPair *pb = (const TestPair *)b;
+
+    if (pa->key != pb->key)
+        return pa->key < pb->key ? -1 : 1;
+    return pa->value < pb->value ? -1 : pa->value > pb->value;
+}
+
+static inline int test_compare_value(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t *)a;
+    uint64_t vb = *(const uint64_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+static inline TestModel *test_model_new(uint64_t capacity)
+{
+    TestModel *model;
+
+    model = (TestModel *)malloc(sizeof(TestModel));
+    model->counts = 0;
+    model->pairs = (TestPair *)malloc(sizeof(TestPair) * capacity);
+    return model;
+}
+
+static inline void test_model_destory(TestModel *model)
+{
+    free(model->pairs);
+    free(model);
+}
+
+// pairs added by hand are sorted at last
+static inline void test_model_sort(TestModel *model)
+{
+    qsort(model->pairs, model->counts, sizeof(TestPair), test_compare_pair);
+}
+
+// first position not less than pair
+static inline uint64_t test_model_lower_bound(TestModel *model, uint64_t key, uint64_t value)
+{
+    TestPair pair;
+    uint64_t low, high, mid;
+
+    pair.key = key;
+    pair.value = value;
+    low = 0;
+    high = model->counts;
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (test_compare_pair(&model->pairs[mid], &pair) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// first position of a key greater than key
+static inline uint64_t test_model_upper_bound(TestModel *model, uint64_t key)
+{
+    uint64_t low, high, mid;
+
+    low = 0;
+    high = model->counts;
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (model->pairs[mid].key <= key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static inline void test_model_insert(TestModel *model, uint64_t key, uint64_t value)
+{
+    uint64_t pos;
+
+    pos = test_model_lower_bound(model, key, value);
+    memmove(model->pairs + pos + 1, model->pairs + pos, sizeof(TestPair) * (model->counts - pos));
+    model->pairs[pos].key = key;
+    model->pairs[pos].value = value;
+    model->counts++;
+}
+
+static inline int test_model_delete_value(TestModel *model, uint64_t key, uint64_t value)
+{
+    uint64_t pos;
+
+    pos = test_model_lower_bound(model, key, value);
+    if (pos == model->counts || model->pairs[pos].key != key || model->pairs[pos].value != value)
+        return 0;
+    memmove(model->pairs + pos, model->pairs + pos + 1, sizeof(TestPair) * (model->counts - pos - 1));
+    model->counts--;
+    return 1;
+}
+
+static inline uint64_t test_model_delete(TestModel *model, uint64_t key)
+{
+    uint64_t pos, end;
+
+    pos = test_model_lower_bound(model, key, 0);
+    end = test_model_upper_bound(model, key);
+    memmove(model->pairs + pos, model->pairs + end, sizeof(TestPair) * (model->counts - end));
+    model->counts -= end - pos;
+    return end - pos;
+}
+
+#endif
@@ -138,7 +138,9 @@ static inline int list_empty(const struct list_head *head)
 
 
 
+#ifndef offsetof
 #define offsetof(type,member)  ((size_t)&(((type *)0)->member))
+#endif
 /**
  * container_of - cast a member of a structure out to the containing structu    re
  *
@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "btree.h"
@@ -41,6 +42,17 @@ Files Structure:
 #define TABLE_FILE_MAGIC 0xaaaaaaaa
 #define COLUMNS 100
 
+// background flusher defaults, and how often it checks thresholds
+#define TABLE_FLUSH_DIRTY_BYTES     (4 << 20)
+#define TABLE_FLUSH_AGE_MS          1000
+#define TABLE_FLUSH_TRICKLE_BLOCKS  64
+#define TABLE_FLUSH_TICK_MS         10
+#define TABLE_FLUSH_AGED_ROUNDS     64
+
+// index built over existing rows is bulk loaded, with room in leaves for
+// rows appended later
+#define TABLE_INDEX_FILL            90
+
  struct _TableRow {
     int64_t properties[COLUMNS];
 } ;
@@ -70,14 +82,31 @@ typedef struct TableIndex {
     const char *dir;                    // used to figure out index file name on disk
     uint64_t    index_flag[COLUMNS];
     BTree      *index_trees[COLUMNS];
+    BTreePool  *pool;                   // shared by all index trees
+    int         shadow;                 // trees are written aside, see table_index_get
 } TableIndex;
 
 
+// background writer of a table, see table_flusher_main
+typedef struct TableFlusher {
+    pthread_t        thread;
+    pthread_cond_t   cond;              // wakes the thread to stop
+    int              stop;
+    uint64_t         dirty_bytes;       // thresholds
+    uint64_t         age_ms;
+    uint64_t         trickle_blocks;    // blocks written in a round at most
+    uint64_t         aged_rounds;       // rounds since changes are too old
+    TableFlushStat   stat;
+} TableFlusher;
+
 struct _Table {
     char            *dir;
     TableIndex      *indexs;
     TableContent    *content;
+    BTreePool       *pool;              // one memory budget for all indexs
     pthread_mutex_t  mutex;
+    uint64_t         dirty_since_ms;    // first change after checkpoint, 0 if none
+    TableFlusher    *flusher;           // NULL if not enabled
 };
 
 
@@ -261,28 +290,40 @@ static void table_content_update_meta(TableContent *content, uint64_t *index_fla
     memcpy(content->meta.index_flag, index_flag, sizeof(uint64_t) * COLUMNS);
 }
 
-static void table_content_flush(TableContent *content)
+// write at most max_rows rows not written yet, meta is not changed.
+// return rows written.
+static uint64_t table_content_write_rows(TableContent *content, uint64_t max_rows)
 {
     ssize_t       rtv;
     TableRow     *row;
-    uint64_t      row_counts;
-    int           i;
+    uint64_t      row_counts, n;
 
     table_content_open_file(content);
-    rtv = lseek(content->file_fd, 0, SEEK_SET);
-    assert(rtv == 0);
-    rtv = write(content->file_fd, &content->meta, sizeof(TableMeta));
-
     row_counts = table_rows_get_counts(content->rows);
-    assert(rtv == sizeof(TableMeta));
-    rtv = lseek(content->file_fd, sizeof(TableRow) * content->next_rowid_to_flush, SEEK_CUR);
-    assert(rtv == sizeof(TableRow) * content->next_rowid_to_flush + sizeof(TableMeta));
-    for(i = content->next_rowid_to_flush; i < row_counts; i++)
+    for(n = 0; n < max_rows && content->next_rowid_to_flush < row_counts; n++)
     {
-        row = table_rows_get_row(content->rows, i);
-        rtv = write(content->file_fd, row, sizeof(TableRow));
+        row = table_rows_get_row(content->rows, content->next_rowid_to_flush);
+        rtv = pwrite(content->file_fd, row, sizeof(TableRow),
+                     sizeof(TableMeta) + sizeof(TableRow) * content->next_rowid_to_flush);
         assert(rtv == sizeof(TableRow));
+        content->next_rowid_to_flush++;
     }
+    return n;
+}
+
+static uint64_t table_content_get_dirty_bytes(TableContent *content)
+{
+    return (table_rows_get_counts(content->rows) - content->next_rowid_to_flush) * sizeof(TableRow);
+}
+
+// rows at first, meta counts them
+static void table_content_flush(TableContent *content)
+{
+    ssize_t       rtv;
+
+    table_content_write_rows(content, UINT64_MAX);
+    rtv = pwrite(content->file_fd, &content->meta, sizeof(TableMeta), 0);
+    assert(rtv == sizeof(TableMeta));
 }
 
 static uint64_t table_content_append_row(TableContent *content, TableRow * row)
@@ -317,26 +358,30 @@ static int table_index_is_exist(TableIndex * index, uint64_t column)
     return index->index_flag[column];
 }
 
-static TableIndex *table_index_new_empty(const char *dir)
+static TableIndex *table_index_new_empty(const char *dir, BTreePool *pool, int shadow)
 {
     TableIndex *index;
     
     index = (TableIndex *)malloc(sizeof(TableIndex));
 
     index->dir = dir;
+    index->pool = pool;
+    index->shadow = shadow;
     memset(index->index_trees, 0, sizeof(BTree *) * COLUMNS);
     memset(index->index_flag, 0, sizeof(uint64_t) * COLUMNS);
 
     return index;
 }
 
-static TableIndex *table_index_new_by_meta(const char *dir, TableMeta *meta)
+static TableIndex *table_index_new_by_meta(const char *dir, TableMeta *meta, BTreePool *pool, int shadow)
 {
     TableIndex *index;
     
     index = (TableIndex *)malloc(sizeof(TableIndex));
 
     index->dir = dir;
+    index->pool = pool;
+    index->shadow = shadow;
     memset(index->index_trees, 0, sizeof(BTree *) * COLUMNS);
     memcpy(index->index_flag, meta->index_flag, sizeof(uint64_t) * COLUMNS);
 
@@ -362,8 +407,13 @@ static BTree *table_index_get(TableIndex *index, uint64_t column, int is_creat)
     {
         table_index_get_path(index, column, full_name);
 
+        memset(&flag, 0, sizeof(flag));
         flag.file = full_name;
         flag.order = 101;
+        flag.pool = index->pool;
+        // blocks written by the flusher or evicted between checkpoints go
+        // aside, a crash leaves the tree of the last one
+        flag.shadow = index->shadow;
         if (is_creat)
         {
             flag.create_if_missing = 1;
@@ -401,11 +451,44 @@ static void table_index_update(TableIndex *index, TableRow *row, uint64_t rowid)
     }
 }
 
+// (value, rowid) pairs of a column in key order, given to bt_bulk_load
+typedef struct TableIndexPairs {
+    uint64_t  *pairs;
+    uint64_t   counts;
+    uint64_t   next;
+} TableIndexPairs;
+
+// by value, rows of same value are in the order bt_insert leaves them:
+// latest first.
+static int table_index_compare_pair(const void *a, const void *b)
+{
+    const uint64_t *pa = (const uint64_t *)a;
+    const uint64_t *pb = (const uint64_t *)b;
+
+    if (pa[0] != pb[0])
+        return pa[0] < pb[0] ? -1 : 1;
+    return pa[1] > pb[1] ? -1 : pa[1] < pb[1];
+}
+
+static int table_index_next_pair(void *arg, uint64_t *key, uint64_t *value)
+{
+    TableIndexPairs *pairs = (TableIndexPairs *)arg;
+
+    if (pairs->next == pairs->counts)
+        return 0;
+    *key = pairs->pairs[pairs->next * 2];
+    *value = pairs->pairs[pairs->next * 2 + 1];
+    pairs->next++;
+    return 1;
+}
+
 static int table_index_create(TableIndex *index, uint64_t column, TableRows *all_rows)
 {
-    BTree     *bt;
-    TableRow  *row;
-    uint64_t   row_counts, rowid, value;
+    BTree           *bt;
+    TableRow        *row;
+    TableIndexPairs  pairs;
+    uint64_t         rowid;
+    int              rtv;
 
     // do nothing if index on this column already exist
     if(index->index_flag[column] != 0)
@@ -419,18 +502,37 @@ static int table_index_create(TableIndex *index, uint64_t column, TableRows *all
     bt = table_index_get(index, column, 1);
     assert(index->index_trees[column] != NULL);
 
-    // update newly created index by all rows
-    row_counts = table_rows_get_counts(all_rows);
-    for(rowid = 0; rowid < row_counts; rowid++)
+    // load newly created index with all rows, sorted by value
+    pairs.counts = table_rows_get_counts(all_rows);
+    pairs.next = 0;
+    pairs.pairs = (uint64_t *)malloc(sizeof(uint64_t) * 2 * pairs.counts);
+    for(rowid = 0; rowid < pairs.counts; rowid++)
     {
         row = table_rows_get_row(all_rows, rowid);
-        value = table_row_get_property(row, column);
-        bt_insert(bt, value, rowid);
+        pairs.pairs[rowid * 2] = table_row_get_property(row, column);
+        pairs.pairs[rowid * 2 + 1] = rowid;
     }
+    if (pairs.counts > 0)
+        qsort(pairs.pairs, pairs.counts, sizeof(uint64_t) * 2, table_index_compare_pair);
+    rtv = bt_bulk_load(bt, table_index_next_pair, &pairs, TABLE_INDEX_FILL);
+    assert(rtv == 0);
+    free(pairs.pairs);
 
     return 0;
 }
 
+// rewrite index trees of all indexed columns with leaves in key order
+static void table_index_compact(TableIndex *index)
+{
+    int i;
+
+    for(i = 0; i < COLUMNS; i++)
+    {
+        if(index->index_flag[i] == 1)
+            bt_compact(table_index_get(index, i, 0), TABLE_INDEX_FILL);
+    }
+}
+
 static void table_index_flush(TableIndex *index)
 {
     int i;
@@ -445,6 +547,35 @@ static void table_index_flush(TableIndex *index)
     }
 }
 
+static uint64_t table_index_get_dirty_bytes(TableIndex *index)
+{
+    uint64_t bytes;
+    int      i;
+
+    bytes = 0;
+    for(i = 0; i < COLUMNS; i++)
+    {
+        if(index->index_trees[i] != NULL)
+            bytes += bt_get_dirty_bytes(index->index_trees[i]);
+    }
+    return bytes;
+}
+
+// write at most max_blocks modified blocks of all index trees
+static uint64_t table_index_write_back(TableIndex *index, uint64_t max_blocks)
+{
+    uint64_t blocks;
+    int      i;
+
+    blocks = 0;
+    for(i = 0; i < COLUMNS && blocks < max_blocks; i++)
+    {
+        if(index->index_trees[i] != NULL)
+            blocks += bt_write_back(index->index_trees[i], max_blocks - blocks);
+    }
+    return blocks;
+}
+
 static void table_index_destory(TableIndex *index)
 {
     int i;
@@ -486,6 +617,129 @@ static void table_unlock(Table *table)
     assert(rtv == 0);
 }
 
+static uint64_t table_now_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// a change is made, age of changes not checkpointed counts from the first
+static void table_marked_dirty(Table *table)
+{
+    if (table->dirty_since_ms == 0)
+        table->dirty_since_ms = table_now_ms();
+}
+
+// called with table locked
+static void table_flush_locked(Table *table)
+{
+    table_content_update_meta(table->content, table->indexs->index_flag);
+    table_content_flush(table->content);
+    table_index_flush(table->indexs);
+    table->dirty_since_ms = 0;
+    if (table->flusher)
+        table->flusher->aged_rounds = 0;
+}
+
+
+// one round writes at most trickle_blocks index blocks and as many rows,
+// then the table is released for a while, so appends are never held
+// for a whole checkpoint.
+//   dirty bytes over threshold:  trickle
+//   oldest change too old:       trickle until all written, then checkpoint.
+//                                if appends keep up with the trickle, or
+//                                blocks can't be written before checkpoint,
+//                                checkpoint after TABLE_FLUSH_AGED_ROUNDS.
+static void *table_flusher_main(void *arg)
+{
+    Table          *table;
+    TableFlusher   *flusher;
+    struct timespec wake;
+    uint64_t        dirty, rows, blocks, written, wait_ms;
+    int             aged;
+
+    table = (Table *)arg;
+    flusher = table->flusher;
+
+    table_lock(table);
+    while (!flusher->stop)
+    {
+        dirty = table_content_get_dirty_bytes(table->content) +
+                table_index_get_dirty_bytes(table->indexs);
+        aged = table->dirty_since_ms &&
+               table_now_ms() - table->dirty_since_ms >= flusher->age_ms;
+
+        written = 0;
+        if (dirty && (aged || dirty >= flusher->dirty_bytes))
+        {
+            rows = table_content_write_rows(table->content, flusher->trickle_blocks);
+            flusher->stat.rows += rows;
+            blocks = table_index_write_back(table->indexs, flusher->trickle_blocks);
+            flusher->stat.blocks += blocks;
+            flusher->stat.rounds++;
+            written = rows + blocks;
+            if (aged)
+                flusher->aged_rounds++;
+        }
+        if (aged && (written == 0 || flusher->aged_rounds >= TABLE_FLUSH_AGED_ROUNDS))
+        {
+            // mostly written, checkpoint has little more than meta blocks to write
+            table_flush_locked(table);
+            flusher->stat.checkpoints++;
+            written = 0;
+        }
+
+        // next round soon if there is more to write
+        wait_ms = written ? 1 : TABLE_FLUSH_TICK_MS;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += wait_ms * 1000000;
+        wake.tv_sec += wake.tv_nsec / 1000000000;
+        wake.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&flusher->cond, &table->mutex, &wake);
+    }
+    table_unlock(table);
+
+    return NULL;
+}
+
+static void table_flusher_start(Table *table, TableOpenFlag *flag)
+{
+    TableFlusher *flusher;
+    int           rtv;
+
+    flusher = (TableFlusher *)malloc(sizeof(TableFlusher));
+    memset(flusher, 0, sizeof(TableFlusher));
+    flusher->dirty_bytes = flag->flush_dirty_bytes ? flag->flush_dirty_bytes : TABLE_FLUSH_DIRTY_BYTES;
+    flusher->age_ms = flag->flush_age_ms ? flag->flush_age_ms : TABLE_FLUSH_AGE_MS;
+    flusher->trickle_blocks = flag->flush_trickle_blocks ? flag->flush_trickle_blocks : TABLE_FLUSH_TRICKLE_BLOCKS;
+    rtv = pthread_cond_init(&flusher->cond, NULL);
+    assert(rtv == 0);
+
+    table->flusher = flusher;
+    rtv = pthread_create(&flusher->thread, NULL, table_flusher_main, table);
+    assert(rtv == 0);
+}
+
+static void table_flusher_stop(Table *table)
+{
+    TableFlusher *flusher;
+    int           rtv;
+
+    flusher = table->flusher;
+    table_lock(table);
+    flusher->stop = 1;
+    pthread_cond_signal(&flusher->cond);
+    table_unlock(table);
+
+    rtv = pthread_join(flusher->thread, NULL);
+    assert(rtv == 0);
+    pthread_cond_destroy(&flusher->cond);
+    free(flusher);
+    table->flusher = NULL;
+}
+
 static TableRows *table_search_by_index(Table *table, uint64_t column, uint64_t min_value, uint64_t max_value, uint64_t limit)
 {
     TableRows   *rows;
@@ -547,17 +801,10 @@ TableRows *table_search_range(Table *table, uint64_t column, uint64_t min_value,
     return rows;
 }
 
+// table_search_range takes the lock
 TableRows *table_search(Table *table, uint64_t column, uint64_t value, uint64_t limit)
 {
-    TableRows *rows;
-
-    table_lock(table);
-
-    rows = table_search_range(table, column, value, value, limit);
-
-    table_unlock(table);
-
-    return rows;
+    return table_search_range(table, column, value, value, limit);
 }
 
 void table_append(Table *table, TableRow *row)
@@ -568,6 +815,7 @@ void table_append(Table *table, TableRow *row)
     
     rowid = table_content_append_row(table->content, row);
     table_index_update(table->indexs, row, rowid);
+    table_marked_dirty(table);
 
     table_unlock(table);
 }
@@ -581,13 +829,15 @@ int table_create_index(Table *table, uint64_t column)
     
     rows = table_content_get_all_rows(table->content);
     rtv = table_index_create(table->indexs, column, rows);
+    table_marked_dirty(table);
     
     table_unlock(table);
     return rtv;
 }
 
-static Table *table_new_empty(const char *dir)
+static Table *table_new_empty(TableOpenFlag *flag)
 {
+    const char *dir = flag->dir;
     Table *table;
     char  *h_dir;
     int    rtv;
@@ -601,19 +851,25 @@ static Table *table_new_empty(const char *dir)
     assert(rtv == 0);
 
     table->dir = h_dir;
+    table->pool = bt_pool_new(flag->cache_size);
     table->content = table_content_new_empty(dir);
-    table->indexs = table_index_new_empty(dir);
+    table->indexs = table_index_new_empty(dir, table->pool, flag->background_flush || flag->cache_size);
+    table->dirty_since_ms = 0;
+    table->flusher = NULL;
     rtv = pthread_mutex_init(&table->mutex, NULL);
     if (rtv != 0)
     {
         table_close(table);
         return NULL;
     }
+    if (flag->background_flush)
+        table_flusher_start(table, flag);
     return table;    
 }
 
-static Table *table_new_from_file(const char *dir)
+static Table *table_new_from_file(TableOpenFlag *flag)
 {
+    const char *dir = flag->dir;
     Table *table;
     char  *h_dir;
     int rtv;
@@ -624,15 +880,20 @@ static Table *table_new_from_file(const char *dir)
     strcpy(h_dir, dir);
 
     table->dir = h_dir;
+    table->pool = bt_pool_new(flag->cache_size);
     table->content = table_content_new_from_file(dir);
-    table->indexs = table_index_new_by_meta(dir, &(table->content->meta));
+    table->indexs = table_index_new_by_meta(dir, &(table->content->meta), table->pool, flag->background_flush || flag->cache_size);
+    table->dirty_since_ms = 0;
+    table->flusher = NULL;
     rtv = pthread_mutex_init(&table->mutex, NULL);
     if (rtv != 0)
     {
         table_close(table);
         return NULL;
     }
-    
+    if (flag->background_flush)
+        table_flusher_start(table, flag);
+
     return table;    
 }
 
@@ -642,29 +903,58 @@ Table *table_open(TableOpenFlag flag)
     {
         if(flag.error_if_exist)
             return NULL;
-        return table_new_from_file(flag.dir);
+        return table_new_from_file(&flag);
     }
     else
     {
         // table not exist!
         if(!flag.create_if_missing)
             return NULL;
-        return table_new_empty(flag.dir);
+        return table_new_empty(&flag);
     }
 }
 
 void table_flush(Table *table)
 {
-    table_content_update_meta(table->content, table->indexs->index_flag);
-    table_content_flush(table->content);
-    table_index_flush(table->indexs);
+    table_lock(table);
+    table_flush_locked(table);
+    table_unlock(table);
+}
+
+// rows are checkpointed first, indexes never refer to rows not on disk
+void table_compact(Table *table)
+{
+    table_lock(table);
+    table_flush_locked(table);
+    table_index_compact(table->indexs);
+    table_unlock(table);
+}
+
+void table_get_flush_stat(Table *table, TableFlushStat *stat)
+{
+    table_lock(table);
+    if (table->flusher)
+        *stat = table->flusher->stat;
+    else
+        memset(stat, 0, sizeof(TableFlushStat));
+    table_unlock(table);
+}
+
+void table_get_cache_stat(Table *table, BTreeCacheStat *stat)
+{
+    table_lock(table);
+    bt_pool_get_stat(table->pool, stat);
+    table_unlock(table);
 }
 
 void table_close(Table *table)
 {
+    if (table->flusher)
+        table_flusher_stop(table);
     pthread_mutex_destroy(&table->mutex);
-    table_flush(table);
+    table_flush_locked(table);
     table_index_destory(table->indexs);
+    bt_pool_destory(table->pool);
     table_content_destory(table->content);
     free(table->dir);
     free(table);
@@ -21,6 +21,8 @@
 
 #include <stdint.h>
 
+#include "btree.h"
+
 
 
 // table_row_new only intend for insert one row into table.
@@ -44,11 +46,38 @@ void       table_rows_destory(TableRows *rows);
 
 
 
+// zero the flag before setting fields, options added later default to 0.
 typedef struct TableOpenFlag {
     const char *dir;
     int         create_if_missing;
     int         error_if_exist;
+    // bytes of index nodes kept in memory, shared by indexs of all columns.
+    // 0 for unlimited. when bounded, index trees are opened in shadow mode,
+    // so modified nodes can be evicted without touching the last checkpoint.
+    uint64_t    cache_size;
+    // a background thread writes new rows and modified index blocks once
+    // they are more than flush_dirty_bytes (0 for 4MB), or the oldest change
+    // is flush_age_ms old (0 for 1000), then checkpoints when all are
+    // written, or after 64 rounds of old changes. it holds the table for
+    // flush_trickle_blocks blocks (0 for 64) at most a round, so appends
+    // don't wait for a whole flush, but a checkpoint writes what is left.
+    // index trees are then opened in shadow mode too (see BTreeOpenFlag),
+    // and their files are converted to it: blocks written by a round go
+    // aside, rows go past the row count of the last checkpoint. a crash
+    // leaves the table and its indexs as of the last checkpoint.
+    int         background_flush;
+    uint64_t    flush_dirty_bytes;
+    uint64_t    flush_age_ms;
+    uint64_t    flush_trickle_blocks;
 } TableOpenFlag;
+
+// work done by the background flusher
+typedef struct TableFlushStat {
+    uint64_t    rounds;
+    uint64_t    rows;           // rows written
+    uint64_t    blocks;         // index blocks written
+    uint64_t    checkpoints;
+} TableFlushStat;
 typedef struct _Table Table;
 
 Table     *table_open(TableOpenFlag flag);
@@ -58,6 +87,11 @@ TableRows *table_search(Table *table, uint64_t column, uint64_t value, uint64_t
 // return value:  0 for success, 1 for already exist
 int  table_create_index(Table *table, uint64_t column);
 void table_flush(Table *table);
+// rewrite each index into a new file with leaves in key order, so range
+// searches on an index grown by appends read it sequentially again.
+void table_compact(Table *table);
+void table_get_flush_stat(Table *table, TableFlushStat *stat);
+void table_get_cache_stat(Table *table, BTreeCacheStat *stat);
 void table_close(Table *table);
 
 #endif // __TABLE_H__
\ No newline at end of file
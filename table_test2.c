@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "table.h"
 
@@ -31,6 +32,7 @@ int main()
     uint64_t        i,j,n,count;
     
 
+    memset(&flag, 0, sizeof(flag));
     flag.dir = "test_table";
     flag.create_if_missing = 1;
     flag.error_if_exist = 0;
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "table.h"
@@ -41,6 +42,7 @@ int main(int argc, char* argv [])
     int insert  = atoi(argv[3]);
     int search = atoi(argv[4]);
 
+    memset(&flag, 0, sizeof(flag));
     flag.dir = dir;
     flag.create_if_missing = 1;
     flag.error_if_exist = 0;
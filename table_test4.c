@@ -0,0 +1,199 @@
+/**
+ * Copyright (C) 2019 zn
+ *
+ * This file is part of btree.
+ *
+ * btree is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * btree is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with btree.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// background flusher: rows and index blocks trickled between checkpoints
+// are found after reopen, or the table is as of the last checkpoint when
+// the process dies in between. indexs rewritten by table_compact find the
+// same rows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "table.h"
+
+#define TEST_DIR "test_table4"
+
+static TableOpenFlag test_flag(int background_flush, uint64_t age_ms)
+{
+    TableOpenFlag flag;
+
+    memset(&flag, 0, sizeof(flag));
+    flag.dir = TEST_DIR;
+    flag.create_if_missing = 1;
+    flag.cache_size = 256 << 10;
+    flag.background_flush = background_flush;
+    flag.flush_dirty_bytes = 64 << 10;
+    flag.flush_age_ms = age_ms;
+    flag.flush_trickle_blocks = 16;
+    return flag;
+}
+
+// row i has i % 1000 in column 0 and i in column 1
+static void test_append(Table *table, uint64_t from, uint64_t to)
+{
+    TableRow *row;
+    uint64_t  i;
+
+    for (i = from; i < to; i++)
+    {
+        row = table_row_new();
+        table_row_set_property(row, 0, i % 1000);
+        table_row_set_property(row, 1, i);
+        table_append(table, row);
+    }
+}
+
+// rows [0, counts) are in table, and found by both indexs
+static void test_check(Table *table, uint64_t counts)
+{
+    TableRows *rows;
+    uint64_t   i, n;
+
+    rows = table_search_range(table, 1, 0, UINT64_MAX, UINT64_MAX);
+    assert(table_rows_get_counts(rows) == counts);
+    table_rows_destory(rows);
+
+    for (i = 0; i < counts + 100; i += 97)
+    {
+        rows = table_search(table, 1, i, 10);
+        assert(table_rows_get_counts(rows) == (i < counts));
+        if (i < counts)
+            assert(table_row_get_property(table_rows_get_row(rows, 0), 0) == i % 1000);
+        table_rows_destory(rows);
+    }
+    for (i = 0; i < 1000; i += 37)
+    {
+        n = counts / 1000 + (i < counts % 1000);
+        rows = table_search(table, 0, i, UINT64_MAX);
+        assert(table_rows_get_counts(rows) == n);
+        table_rows_destory(rows);
+    }
+}
+
+// wait until the flusher has trickled index blocks and done n checkpoints
+static void test_wait_flusher(Table *table, uint64_t checkpoints)
+{
+    TableFlushStat stat;
+
+    do
+    {
+        usleep(1000);
+        table_get_flush_stat(table, &stat);
+    } while (stat.blocks == 0 || stat.rows == 0 || stat.checkpoints < checkpoints);
+    assert(stat.rounds > 0);
+}
+
+// old changes are trickled and checkpointed without table_flush
+static void test_flusher()
+{
+    Table   *table;
+
+    system("rm -rf " TEST_DIR);
+    table = table_open(test_flag(1, 5));
+    table_create_index(table, 0);
+    table_create_index(table, 1);
+    test_append(table, 0, 50000);
+    test_wait_flusher(table, 1);
+    test_check(table, 50000);
+    table_close(table);
+
+    table = table_open(test_flag(0, 0));
+    test_check(table, 50000);
+    table_close(table);
+    printf("flusher ok\n");
+}
+
+// the process dies while index blocks are trickled, never checkpointed.
+// indexs written aside are still as of the last table_flush.
+static void test_flusher_crash()
+{
+    Table   *table;
+
+    system("rm -rf " TEST_DIR);
+    table = table_open(test_flag(0, 0));
+    table_create_index(table, 0);
+    table_create_index(table, 1);
+    test_append(table, 0, 20000);
+    table_close(table);
+
+    if (fork() == 0)
+    {
+        table = table_open(test_flag(1, 1000000));
+        test_append(table, 20000, 60000);
+        test_wait_flusher(table, 0);
+        _exit(0);
+    }
+    wait(NULL);
+
+    table = table_open(test_flag(0, 0));
+    test_check(table, 20000);
+    test_append(table, 20000, 30000);
+    table_close(table);
+
+    table = table_open(test_flag(1, 5));
+    test_check(table, 30000);
+    table_close(table);
+    printf("flusher crash ok\n");
+}
+
+// indexs are compacted with rows not yet flushed, then more rows go on.
+// without the flusher or a cache size, index trees are not in shadow mode.
+static void test_compact(int background_flush)
+{
+    TableOpenFlag  flag;
+    Table         *table;
+
+    system("rm -rf " TEST_DIR);
+    flag = test_flag(background_flush, 5);
+    if (!background_flush)
+        flag.cache_size = 0;
+    table = table_open(flag);
+    table_create_index(table, 0);
+    test_append(table, 0, 30000);
+    table_create_index(table, 1);
+    test_append(table, 30000, 40000);
+    table_compact(table);
+    test_check(table, 40000);
+    test_append(table, 40000, 50000);
+    test_check(table, 50000);
+    table_compact(table);
+    table_close(table);
+
+    table = table_open(test_flag(0, 0));
+    test_check(table, 50000);
+    table_close(table);
+    printf("compact (background flush %d) ok\n", background_flush);
+}
+
+int main()
+{
+    test_flusher();
+    test_flusher_crash();
+    test_compact(0);
+    test_compact(1);
+
+    system("rm -rf " TEST_DIR);
+    printf("table_test4 ok\n");
+    return 0;
+}